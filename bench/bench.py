@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmarks of the Malbolge Unshackled interpreter.
+
+Generates a fixed corpus of programs and inputs (once, into bench/corpus),
+runs every program with a fixed seed and reports steps per second, wall
+time, peak RSS and a checksum of the output as JSON. The output checksum,
+exit status and step count of every run do not depend on the machine and
+are compared with bench/checksums.json, which is kept in the repository;
+--save-checksums rewrites it after an intended change of behaviour. With
+--baseline FILE the wall times are compared with the ones saved in FILE
+by --save on the same machine. A changed output or a wall time beyond the
+tolerance is reported as a regression, and the exit status is 1.
+
+Run by make bench and make bench-baseline.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+JMP, OUT, IN, ROT, MOVD, OPR, NOP, HLT = 4, 5, 23, 39, 40, 62, 68, 81
+SEED = 1  # rotation width policy of every run
+NOISE = 0.01  # seconds below which differences in wall time are not regressions
+
+
+def cell(op, pos):
+    """Source character executing op at address pos."""
+    v = (op - pos) % 94
+    while v < 33:
+        v += 94
+    return chr(v)
+
+
+def program(ops):
+    chars = {op: [cell(op, pos) for pos in range(94)] for op in set(ops)}
+    return ''.join(chars[op][pos % 94] for pos, op in enumerate(ops)).encode()
+
+
+def straight(seed, n, weights, prefix=()):
+    """n instructions drawn with weights from OUT, IN, ROT, MOVD, OPR and NOP, then HLT."""
+    r = random.Random(seed)
+    ops = list(prefix)
+    ops += r.choices([OUT, IN, ROT, MOVD, OPR, NOP], weights, k=n-len(ops))
+    return program(ops + [HLT])
+
+
+def text(seed, n):
+    r = random.Random(seed)
+    words = ['malbolge', 'unshackled', 'trit', 'rotation', 'width', 'crazy', 'xlat2', 'été', '中']
+    out = []
+    size = 0
+    while size < n:
+        out.append(' '.join(r.choice(words) for _ in range(r.randint(3, 12))) + '\n')
+        size += len(out[-1])
+    return ''.join(out)[:n].encode()
+
+
+# name -> function returning the program and its input
+BENCHMARKS = {
+    # in and out pairs echoing a greeting: dominated by startup
+    'hello': lambda: (program([IN, OUT]*14 + [HLT]), b'Hello, world!\n'),
+    # in and out pairs echoing a megabyte of text
+    'cat': lambda: (program([IN, OUT]*1000000 + [HLT]), text(1, 1000000)),
+    # long straight runs of code in place of a loop: jmp needs its target
+    # in the cell D points at, and a generated program cannot keep that up
+    # while xlat2 changes every cell it executes
+    'straight': lambda: (straight(2, 3000000, [3, 0, 0, 0, 0, 20]), b''),
+    'output': lambda: (straight(3, 3000000, [1, 0, 0, 0, 0, 0]), b''),
+    'input': lambda: (straight(4, 3000000, [1, 20, 0, 0, 0, 5]), text(2, 3000000)),
+    # D moved behind C, then rot, opr and movd on wide input: the rotation
+    # width grows to 106496 trits
+    'growth': lambda: (straight(4, 4999, [0, 1, 1, 1, 1, 10], [NOP]*200 + [MOVD]),
+            '\U0010ffff中'.encode()*5000),
+    # a program of 12 million cells: dominated by loading
+    'large': lambda: (straight(5, 12000000, [1, 0, 0, 0, 0, 50]), b''),
+}
+
+
+def write_corpus(path, names):
+    os.makedirs(path, exist_ok=True)
+    for name in names:
+        src, inp = BENCHMARKS[name]()
+        with open(os.path.join(path, name + '.mb'), 'wb') as f:
+            f.write(src)
+        with open(os.path.join(path, name + '.in'), 'wb') as f:
+            f.write(inp)
+
+
+def read_steps(binary, page):
+    out = subprocess.run([binary, '--read-metrics', page], capture_output=True, text=True, check=True).stdout
+    for line in out.splitlines():
+        if line.startswith('unshackled_steps_total'):
+            return int(line.split()[-1])
+    raise RuntimeError('no step count in ' + page)
+
+
+def run_once(binary, prog, inp, page):
+    """Returns (seconds, peak RSS in KiB, checksum, status, steps)."""
+    with open(inp, 'rb') as stdin, tempfile.TemporaryFile() as stdout:
+        start = time.monotonic()
+        p = subprocess.Popen([binary, '--seed', str(SEED), '--metrics', page, prog],
+                stdin=stdin, stdout=stdout, stderr=subprocess.PIPE)
+        err = p.stderr.read()
+        _, status, usage = os.wait4(p.pid, 0)
+        seconds = time.monotonic() - start
+        p.returncode = os.waitstatus_to_exitcode(status)
+        stdout.seek(0)
+        h = hashlib.sha256()
+        for block in iter(lambda: stdout.read(1 << 20), b''):
+            h.update(block)
+        h.update(err)
+    return seconds, usage.ru_maxrss, h.hexdigest()[:16], p.returncode, read_steps(binary, page)
+
+
+def run(binary, path, names, runs):
+    results = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        page = os.path.join(tmp, 'metrics')
+        for name in names:
+            prog = os.path.join(path, name + '.mb')
+            inp = os.path.join(path, name + '.in')
+            best = None
+            for _ in range(runs):
+                r = run_once(binary, prog, inp, page)
+                if best and r[2:] != best[2:]:
+                    raise RuntimeError(name + ': output differs between runs')
+                if not best or r[0] < best[0]:
+                    best = r
+            seconds, rss, checksum, status, steps = best
+            results[name] = {
+                'steps': steps,
+                'seconds': round(seconds, 4),
+                'steps_per_second': round(steps/seconds),
+                'max_rss_kb': rss,
+                'checksum': checksum,
+                'status': status,
+            }
+            print('%-10s %12d steps %9.3f s %12d steps/s %9d KiB  %s' % (name, steps, seconds,
+                    steps/seconds, rss, checksum), file=sys.stderr)
+    return results
+
+
+OUTPUT = ('checksum', 'status', 'steps')
+
+
+def check_outputs(results, expected):
+    """Returns the benchmarks of results whose output differs from expected."""
+    regressions = []
+    for name, r in results.items():
+        e = expected.get(name)
+        if not e:
+            print('warning: no checksum for %s' % name, file=sys.stderr)
+        elif any(r[k] != e[k] for k in OUTPUT):
+            regressions.append('%s: output changed' % name)
+    return regressions
+
+
+def compare(results, baseline, tolerance):
+    """Returns the regressions of the wall times of results against baseline."""
+    regressions = []
+    for name, r in results.items():
+        b = baseline.get(name)
+        if b and r['seconds'] > b['seconds']*(1+tolerance) + NOISE:
+            regressions.append('%s: %.3f s, baseline %.3f s' % (name, r['seconds'], b['seconds']))
+    return regressions
+
+
+def load(path):
+    with open(path) as f:
+        report = json.load(f)
+    if report['seed'] != SEED:
+        raise RuntimeError('%s: results of seed %d' % (path, report['seed']))
+    return report['benchmarks']
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    ap = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    ap.add_argument('--binary', default=os.path.join(here, '..', 'unshackled'))
+    ap.add_argument('--corpus', default=os.path.join(here, 'corpus'))
+    ap.add_argument('--runs', type=int, default=3, help='runs of each benchmark; the fastest counts')
+    ap.add_argument('--baseline', help='compare with the results in this file')
+    ap.add_argument('--tolerance', type=float, default=0.15, help='allowed increase in wall time')
+    ap.add_argument('--save', help='write the results to this file')
+    ap.add_argument('--checksums', default=os.path.join(here, 'checksums.json'),
+            help='compare the outputs with the ones in this file')
+    ap.add_argument('--save-checksums', action='store_true', help='write the outputs to the --checksums file')
+    ap.add_argument('names', nargs='*', help='benchmarks to run; default: all')
+    args = ap.parse_args()
+
+    names = args.names or list(BENCHMARKS)
+    unknown = [n for n in names if n not in BENCHMARKS]
+    if unknown:
+        ap.error('unknown benchmark: ' + ', '.join(unknown))
+    write_corpus(args.corpus, [n for n in names if not os.path.exists(os.path.join(args.corpus, n + '.in'))])
+    results = run(os.path.abspath(args.binary), args.corpus, names, args.runs)
+    report = {'binary': args.binary, 'seed': SEED, 'benchmarks': results}
+    json.dump(report, sys.stdout, indent=2)
+    print()
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+    if args.save_checksums:
+        expected = load(args.checksums) if os.path.exists(args.checksums) else {}
+        expected.update({name: {k: r[k] for k in OUTPUT} for name, r in results.items()})
+        with open(args.checksums, 'w') as f:
+            json.dump({'seed': SEED, 'benchmarks': expected}, f, indent=2, sort_keys=True)
+            f.write('\n')
+    regressions = check_outputs(results, load(args.checksums))
+    if args.baseline:
+        if os.path.exists(args.baseline):
+            regressions += compare(results, load(args.baseline), args.tolerance)
+        else:
+            print('warning: no baseline %s, wall times not compared; make bench-baseline saves one'
+                    % args.baseline, file=sys.stderr)
+    for r in regressions:
+        print('regression: ' + r, file=sys.stderr)
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
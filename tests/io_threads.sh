@@ -0,0 +1,37 @@
+#!/bin/sh
+# --io-threads must move more symbols than a ring holds (RING_SIZE) through
+# both rings without stalling.
+set -e
+BIN=${1:-./unshackled}
+N=200000
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+# writes a program of 2*N instructions to $1, then hlt; $2 is an awk
+# expression for the instruction at pos: in 23, out 5, nop 68
+program() {
+	awk -v n=$N "BEGIN {
+		for (pos = 0; pos <= 2*n; pos++) {
+			op = (pos == 2*n ? 81 : $2)
+			v = ((op - pos) % 94 + 94) % 94
+			while (v < 33) v += 94
+			printf \"%c\", v
+		}
+	}" > "$T/$1"
+}
+
+program cat.mb 'pos % 2 ? 5 : 23'
+program out.mb '5'
+program in.mb 'pos % 64 == 63 ? 5 : pos % 2 ? 68 : 23'
+awk -v n=$N 'BEGIN { for (i = 0; i < n; i++) printf "%c", 97 + i % 26 }' > "$T/in"
+
+# in and out pairs copy the input
+timeout 20 "$BIN" --io-threads "$T/cat.mb" < "$T/in" > "$T/out"
+cmp "$T/in" "$T/out"
+# only output, with the input at its end: A is 0, so every out writes a NUL
+timeout 20 "$BIN" --io-threads "$T/out.mb" < /dev/null > "$T/out"
+test "$(wc -c < "$T/out")" -eq $((2*N))
+# mostly input, with an out after every 32 symbols read
+timeout 20 "$BIN" --io-threads "$T/in.mb" < "$T/in" > "$T/out"
+timeout 20 "$BIN" "$T/in.mb" < "$T/in" | cmp - "$T/out"
+echo "io_threads: ok"
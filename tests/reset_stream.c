@@ -0,0 +1,108 @@
+/**
+ * Resetting a vm to a snapshot must give the same run again, whether the
+ * program was loaded with mu_load or streamed with mu_load_stream. The
+ * program moves D onto cells that have not been streamed yet and changes
+ * them with opr, so the undo log has to hold values the loader built.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../unshackled.h"
+
+#define RUNS 3
+#define PROGRAM_SIZE 64
+
+typedef struct Output {
+	int32_t symbols[64];
+	size_t count;
+} Output;
+
+static int collect(void* ctx, int32_t symbol) {
+	Output* out = (Output*)ctx;
+	if (out->count < 64) {
+		out->symbols[out->count++] = symbol;
+	}
+	return 0;
+}
+
+// source character executing op at pos
+static char instruction(int op, int pos) {
+	int v = ((op - pos) % 94 + 94) % 94;
+	while (v < 33) {
+		v += 94;
+	}
+	return (char)v;
+}
+
+// movd, then opr and out five times, then hlt; the movd points D at the
+// nops after the hlt, which are only reached through D
+static size_t build_program(char* src) {
+	static const int ops[] = {40, 62, 5, 62, 5, 62, 5, 62, 5, 62, 5, 81};
+	size_t n = sizeof(ops)/sizeof(ops[0]);
+	for (size_t i=0; i<PROGRAM_SIZE; i++) {
+		src[i] = instruction((i < n ? ops[i] : 68),(int)i);
+	}
+	return PROGRAM_SIZE;
+}
+
+// runs vm to the end RUNS times, resetting in between; returns 0 if all runs agree
+static int check_runs(MuVm* vm, const char* name) {
+	Output first, out;
+	int first_status = 0;
+	if (mu_snapshot(vm) != 0) {
+		fprintf(stderr,"%s: snapshot failed: %s\n",name,mu_error(vm));
+		return 1;
+	}
+	for (int run=0; run<RUNS; run++) {
+		memset(&out,0,sizeof(out));
+		MuIo io = {0, collect, &out};
+		mu_set_io(vm,&io);
+		int status = mu_run(vm,1000);
+		if (run == 0) {
+			first = out;
+			first_status = status;
+		}else if (status != first_status || out.count != first.count
+				|| memcmp(out.symbols,first.symbols,out.count*sizeof(int32_t)) != 0) {
+			fprintf(stderr,"%s: run %d differs from the first\n",name,run+1);
+			return 1;
+		}
+		if (mu_reset(vm) != 0) {
+			fprintf(stderr,"%s: reset failed: %s\n",name,mu_error(vm));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(void) {
+	char src[PROGRAM_SIZE];
+	size_t size = build_program(src);
+	int failed = 0;
+
+	MuVm* vm = mu_create(1);
+	if (mu_load(vm,src,size,1) != 0) {
+		fprintf(stderr,"mu_load: %s\n",mu_error(vm));
+		return 1;
+	}
+	failed |= check_runs(vm,"mu_load");
+	mu_destroy(vm);
+
+	int fds[2];
+	if (pipe(fds) != 0 || write(fds[1],src,size) != (ssize_t)size) {
+		perror("pipe");
+		return 1;
+	}
+	close(fds[1]);
+	vm = mu_create(1);
+	mu_load_stream(vm,fds[0]);
+	failed |= check_runs(vm,"mu_load_stream");
+	mu_destroy(vm);
+	close(fds[0]);
+
+	if (!failed) {
+		printf("reset_stream: ok\n");
+	}
+	return failed;
+}
@@ -5,7 +5,9 @@
  * Malbolge Unshackled uses Unicode for I/O. This interpreter uses UTF-8
  * encoding when the program reads from stdin or writes to stdout.
  *
- * Please compile with -O3 flag.
+ * Please compile with -O3 flag. Compiled with -DUNSHACKLED_LIBRARY, this
+ * file is the library declared in unshackled.h, without the command line
+ * interface.
  * 
  * 2017 Matthias Lutter.
  * Please visit <https://lutter.cc/unshackled/>
@@ -17,11 +19,36 @@
  * See <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <inttypes.h>
 #include <malloc.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdio_ext.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef PROFILE
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "unshackled.h"
 
 #define T0 0
 #define T1 1
@@ -40,12 +67,14 @@ typedef struct Number {
 	uintmax_t width;
 	Trits* tail;
 	struct MemCell* memptr; // pointer to memory[Number]; 0: to be computed
-	int32_t unicode; // unicode codepoint of number; -1: not an unicode codepoint; -2: to be computed
+	int32_t unicode; // unicode codepoint of number; -1: not an unicode codepoint; -2: to be computed; -3: newline
 } Number;
 
 typedef struct MemCell {
 	Number* val;
 	struct MemCell* next; // pointer to next memory cell (to save computation time)
+	int dirty; // changed since the last checkpoint
+	int saved; // original value is in the undo log
 } MemCell;
 
 typedef struct MemoryTree {
@@ -53,6 +82,146 @@ typedef struct MemoryTree {
 	struct MemoryTree* child[3];
 } MemoryTree;
 
+#ifdef PROFILE
+/*
+ * Profiling, compiled in with -DPROFILE only (make unshackled-profile),
+ * so the normal build does not pay for it. The counters are written as
+ * JSON by --profile FILE. Histograms are indexed by width or depth; the
+ * last entry counts PROFILE_WIDTHS and more.
+ *
+ * Each phase is also measured with the hardware counters of the thread
+ * that created the vm, in user space only, if perf_event_open allows it.
+ * Counters the machine lacks are left out, and without any the profile
+ * has times only.
+ */
+
+#define PROFILE_WIDTHS 64
+
+// phases
+#define PROFILE_LOAD 0
+#define PROFILE_FILL 1 // memory behind the program and initial values
+#define PROFILE_RUN 2
+#define PROFILE_PHASES 3
+
+// hardware counters: cycles, instructions, cache misses, branch misses
+#define PROFILE_COUNTERS 4
+
+typedef struct Profile {
+	uintmax_t ops[94]; // executions by (instruction+position)%94
+	MemCell* cells; // cells of a program loaded from source; 0: none
+	uintmax_t* cell_counts; // executions of each program cell
+	size_t* offsets; // offset of each program cell in the source
+	uintmax_t cell_count;
+	uintmax_t outside; // executions of the other cells
+	uintmax_t cached; // update_memptr calls answered by the cache
+	uintmax_t walks[PROFILE_WIDTHS+1]; // update_memptr trie walks by depth
+	uintmax_t widths[3][PROFILE_WIDTHS+1]; // widths of A, C and D before every step
+	double seconds[PROFILE_PHASES];
+	int counter_group; // file descriptor of the group leader; -1: no counters
+	int counter_error; // errno of the first counter that could not be opened
+	int counter_fds[PROFILE_COUNTERS]; // -1: not available
+	int counter_index[PROFILE_COUNTERS]; // position in the values read from the group
+	uint64_t counters[PROFILE_PHASES][PROFILE_COUNTERS];
+} Profile;
+
+// start of a measurement
+typedef struct ProfileMark {
+	double seconds;
+	uint64_t counters[PROFILE_COUNTERS];
+	uint64_t enabled; // times the group was enabled and running
+	uint64_t running;
+} ProfileMark;
+
+static double profile_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// opens the counters available as one group counting the calling thread
+static void open_counters(Profile* p) {
+	static const uint64_t events[PROFILE_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+	p->counter_group = -1;
+	p->counter_error = 0;
+	int n = 0;
+	for (int i=0; i<PROFILE_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr,0,sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = events[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		int fd = (int)syscall(SYS_perf_event_open,&attr,0,-1,p->counter_group,0);
+		p->counter_fds[i] = fd;
+		p->counter_index[i] = -1;
+		if (fd < 0) {
+			if (!p->counter_error) {
+				p->counter_error = errno;
+			}
+			continue;
+		}
+		if (p->counter_group < 0) {
+			p->counter_group = fd;
+		}
+		p->counter_index[i] = n++;
+	}
+}
+
+static void close_counters(Profile* p) {
+	for (int i=0; i<PROFILE_COUNTERS; i++) {
+		if (p->counter_fds[i] >= 0) {
+			close(p->counter_fds[i]);
+		}
+	}
+}
+
+static void profile_mark(Profile* p, ProfileMark* m) {
+	m->seconds = profile_clock();
+	if (p->counter_group < 0) {
+		return;
+	}
+	uint64_t values[3+PROFILE_COUNTERS]; // count, time enabled, time running, counters
+	if (read(p->counter_group,values,sizeof(values)) < (ssize_t)(3*sizeof(uint64_t))) {
+		p->counter_error = errno;
+		p->counter_group = -1;
+		return;
+	}
+	m->enabled = values[1];
+	m->running = values[2];
+	for (int i=0; i<PROFILE_COUNTERS; i++) {
+		m->counters[i] = (p->counter_index[i] >= 0 ? values[3+p->counter_index[i]] : 0);
+	}
+}
+
+// adds the time and counts since m to phase and moves m to now
+static void profile_phase(Profile* p, int phase, ProfileMark* m) {
+	int counting = (p->counter_group >= 0);
+	ProfileMark now;
+	profile_mark(p,&now);
+	p->seconds[phase] += now.seconds - m->seconds;
+	if (counting && p->counter_group >= 0) {
+		uint64_t enabled = now.enabled - m->enabled;
+		uint64_t running = now.running - m->running;
+		for (int i=0; i<PROFILE_COUNTERS; i++) {
+			uint64_t count = now.counters[i] - m->counters[i];
+			if (running && running < enabled) {
+				// the kernel shared the hardware with other groups
+				count = (uint64_t)((double)count*enabled/running);
+			}
+			p->counters[phase][i] += count;
+		}
+	}
+	*m = now;
+}
+
+static inline void profile_width(uintmax_t* histogram, uintmax_t width) {
+	histogram[width < PROFILE_WIDTHS ? width : PROFILE_WIDTHS]++;
+}
+#endif
+
 static inline void* malloc_or_die(size_t size) {
 	void* mem = malloc(size);
 	if (!mem) {
@@ -62,18 +231,150 @@ static inline void* malloc_or_die(size_t size) {
 	return mem;
 }
 
+/*
+ * Trits, numbers, cells and trie nodes are carved from large chunks.
+ * Trits and numbers are recycled through free lists; cells and trie nodes
+ * are never freed. Objects inside a mapped program image or built in bulk
+ * by the loader may be recycled the same way. Every vm has a heap of its
+ * own, which is released as a whole when the vm is destroyed.
+ */
+#define POOL_CHUNK 4096
+
+typedef struct Block {
+	struct Block* next;
+	max_align_t data[];
+} Block;
+
+typedef struct Pool {
+	char* next;
+	char* end;
+	void* free; // list of recycled objects, linked through their first word
+	size_t live; // objects in use, including those built in bulk or mapped
+	size_t peak;
+} Pool;
+
+typedef struct Heap {
+	Pool trits;
+	Pool numbers;
+	Pool cells;
+	Pool nodes;
+	Block* blocks; // chunks of the pools and bulk arrays
+	size_t size; // bytes in blocks; also the peak, as blocks are never released early
+#ifdef PROFILE
+	Profile* profile; // 0 in the heaps of loader threads
+#endif
+} Heap;
+
+// allocates memory that is released together with the heap
+static void* heap_block(Heap* heap, size_t size) {
+	Block* block = (Block*)malloc_or_die(sizeof(Block) + size);
+	block->next = heap->blocks;
+	heap->blocks = block;
+	heap->size += sizeof(Block) + size;
+	return block->data;
+}
+
+// hands the blocks of src over to heap
+static void merge_heap(Heap* heap, Heap* src) {
+	Block** end = &src->blocks;
+	while (*end) {
+		end = &(*end)->next;
+	}
+	*end = heap->blocks;
+	heap->blocks = src->blocks;
+	heap->size += src->size;
+	src->blocks = 0;
+	src->size = 0;
+	Pool* pools[4][2] = {{&heap->trits, &src->trits}, {&heap->numbers, &src->numbers},
+			{&heap->cells, &src->cells}, {&heap->nodes, &src->nodes}};
+	for (int i=0; i<4; i++) {
+		pools[i][0]->live += pools[i][1]->live;
+		pools[i][0]->peak += pools[i][1]->peak;
+		pools[i][1]->live = 0;
+		pools[i][1]->peak = 0;
+	}
+}
+
+static void free_heap(Heap* heap) {
+	while (heap->blocks) {
+		Block* next = heap->blocks->next;
+		free(heap->blocks);
+		heap->blocks = next;
+	}
+}
+
+// counts objects that are in use without pool_alloc
+static inline void pool_add_live(Pool* pool, size_t count) {
+	pool->live += count;
+	if (pool->live > pool->peak) {
+		pool->peak = pool->live;
+	}
+}
+
+static inline void* pool_alloc(Heap* heap, Pool* pool, size_t size) {
+	pool_add_live(pool,1);
+	if (pool->free) {
+		void* mem = pool->free;
+		pool->free = *(void**)mem;
+		return mem;
+	}
+	if (pool->next == pool->end) {
+		pool->next = (char*)heap_block(heap,size*POOL_CHUNK);
+		pool->end = pool->next + size*POOL_CHUNK;
+	}
+	void* mem = pool->next;
+	pool->next += size;
+	return mem;
+}
+
+static inline void pool_free(Pool* pool, void* mem) {
+	pool->live--;
+	*(void**)mem = pool->free;
+	pool->free = mem;
+}
+
+static inline Trits* alloc_trits(Heap* heap) {
+	return (Trits*)pool_alloc(heap,&heap->trits,sizeof(Trits));
+}
+
+static inline void free_trits(Heap* heap, Trits* t) {
+	pool_free(&heap->trits,t);
+}
+
+static inline Number* alloc_number(Heap* heap) {
+	return (Number*)pool_alloc(heap,&heap->numbers,sizeof(Number));
+}
+
+static inline MemCell* alloc_cell(Heap* heap) {
+	return (MemCell*)pool_alloc(heap,&heap->cells,sizeof(MemCell));
+}
+
+static inline MemoryTree* alloc_node(Heap* heap) {
+	return (MemoryTree*)pool_alloc(heap,&heap->nodes,sizeof(MemoryTree));
+}
+
+#define RANDOM_MAX 0x7fffffff
+
+// splitmix64; returns a value between 0 and RANDOM_MAX
+static inline uintmax_t next_random(uint64_t* state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return (uintmax_t)((z ^ (z >> 31)) >> 33);
+}
+
+// the growth policies return 0 if the maximal rotation width is exceeded
+
 // step: fixed value between 4 and 12; slack: fixed value between 0 and 5
 static inline uintmax_t det_growth_policy(uintmax_t new_wordwidth, uintmax_t old_rotwidth, uintmax_t step, uintmax_t slack) {
 	uintmax_t ret = old_rotwidth;
 	if (new_wordwidth > (old_rotwidth - slack)/2) {
 		if (old_rotwidth > UINTMAX_MAX-step) {
-			fprintf(stderr,"maximal supported rotation width exceeded\n");
-			exit(1);
+			return 0;
 		}
 		ret = old_rotwidth + step;
 		if (new_wordwidth > UINTMAX_MAX/2) {
-			fprintf(stderr,"maximal supported rotation width exceeded\n");
-			exit(1);
+			return 0;
 		}
 		uintmax_t alt = 2*new_wordwidth;
 		if (alt > ret) {
@@ -83,35 +384,42 @@ static inline uintmax_t det_growth_policy(uintmax_t new_wordwidth, uintmax_t old
 	return ret;
 }
 
-// prob: fixed value between 0.2*RAND_MAX and 0.8*RAND_MAX; slack: fixed value between 0 and 5
-static inline uintmax_t nondet_growth_policy(uintmax_t new_wordwidth, uintmax_t old_rotwidth, uintmax_t prob, uintmax_t slack) {
+// prob: fixed value between 0.2*RANDOM_MAX and 0.8*RANDOM_MAX; slack: fixed value between 0 and 5
+static inline uintmax_t nondet_growth_policy(uintmax_t new_wordwidth, uintmax_t old_rotwidth, uintmax_t prob, uintmax_t slack, uint64_t* random) {
 	uintmax_t ret = old_rotwidth;
 	int change = 0;
 	if (new_wordwidth > old_rotwidth/2) {
 		change = 1;
 	}
-	if (rand() <= prob) {
+	if (next_random(random) <= prob) {
 		change = 1;
 	}
 	if (change) {
 		if (new_wordwidth > UINTMAX_MAX/2) {
-			fprintf(stderr,"maximal supported rotation width exceeded\n");
-			exit(1);
+			return 0;
 		}
 		if (2*new_wordwidth > ret) {
 			ret = 2*new_wordwidth;
 		}
-		uintmax_t rnd = rand() % (slack+1);
+		uintmax_t rnd = next_random(random) % (slack+1);
 		if (ret > UINTMAX_MAX-rnd) {
-			fprintf(stderr,"maximal supported rotation width exceeded\n");
-			exit(1);
+			return 0;
 		}
 		ret += rnd;
 	}
 	return ret;
 }
 
-static inline void update_memptr(Number* n, MemoryTree m[]) {
+static inline void update_memptr(Heap* heap, Number* n, MemoryTree m[]) {
+#ifdef PROFILE
+	if (heap->profile) {
+		if (n->memptr) {
+			heap->profile->cached++;
+		}else{
+			profile_width(heap->profile->walks,n->width);
+		}
+	}
+#endif
 	if (n->memptr) return;
 	MemoryTree* cur_node = &m[n->head];
 	MemCell* last_match = cur_node->cell;
@@ -121,14 +429,16 @@ static inline void update_memptr(Number* n, MemoryTree m[]) {
 			cur_node = cur_node->child[it->trit];
 			last_match = cur_node->cell;
 		}else {
-			cur_node->child[it->trit] = (MemoryTree*)malloc_or_die(sizeof(MemoryTree));
+			cur_node->child[it->trit] = alloc_node(heap);
 			cur_node = cur_node->child[it->trit];
 			if (it->trit == n->head) {
 				cur_node->cell = last_match;
 			}else{
-				cur_node->cell = (MemCell*)malloc_or_die(sizeof(MemCell));
+				cur_node->cell = alloc_cell(heap);
 				cur_node->cell->val = 0;
 				cur_node->cell->next = 0;
+				cur_node->cell->dirty = 0;
+				cur_node->cell->saved = 0;
 			}
 			cur_node->child[0] = 0;
 			cur_node->child[1] = 0;
@@ -172,13 +482,13 @@ static inline int is_nl(Number* n) {
 	return 1;
 }
 
-static inline Number* clone_number(Number* in){
-	Number* n = (Number*)malloc_or_die(sizeof(Number));
+static inline Number* clone_number(Heap* heap, Number* in){
+	Number* n = alloc_number(heap);
 	n->head = in->head;
 	n->width = in->width;
 	n->memptr = in->memptr;
 	n->unicode = in->unicode;
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
+	n->tail = alloc_trits(heap);
 	n->tail->left = n->tail;
 	n->tail->right = n->tail;
 	Trits* it = n->tail;
@@ -188,7 +498,7 @@ static inline Number* clone_number(Number* in){
 		if (i==in->width-1) {
 			it->left = n->tail;
 		}else{
-			it->left = (Trits*)malloc_or_die(sizeof(Trits));
+			it->left = alloc_trits(heap);
 		}
 		it->left->right = it;
 		it = it->left;
@@ -197,46 +507,59 @@ static inline Number* clone_number(Number* in){
 	return n;
 }
 
-static inline void copy_number(Number* n, Number* in) {
-	// clear old trit sequence
-	Trits* it = n->tail;
-	for (uintmax_t i=0; i<n->width; i++) {
-		Trits* tmp = it;
-		it = it->left;
-		free(tmp);
+// overwrites n with in, reusing the trits of n
+static inline void copy_number(Heap* heap, Number* n, Number* in) {
+	uintmax_t old_width = n->width;
+	if (!old_width) {
+		n->tail = alloc_trits(heap);
+		n->tail->left = n->tail;
+		n->tail->right = n->tail;
+		old_width = 1;
 	}
 	n->head = in->head;
 	n->width = in->width;
 	n->memptr = in->memptr;
 	n->unicode = in->unicode;
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
-	n->tail->left = n->tail;
-	n->tail->right = n->tail;
-	it = n->tail;
+	Trits* it = n->tail;
 	Trits* in_it = in->tail;
-	for (uintmax_t i=0;i<in->width;i++) {
-		it->trit = in_it->trit;
-		if (i==in->width-1) {
-			it->left = n->tail;
-		}else{
-			it->left = (Trits*)malloc_or_die(sizeof(Trits));
+	for (uintmax_t i=0; i<in->width; i++) {
+		if (i >= old_width) {
+			Trits* t = alloc_trits(heap);
+			t->right = it;
+			t->left = n->tail;
+			it->left = t;
+			n->tail->right = t;
 		}
-		it->left->right = it;
-		it = it->left;
+		if (i) {
+			it = it->left;
+		}
+		it->trit = in_it->trit;
 		in_it = in_it->left;
 	}
+	uintmax_t kept = (in->width ? in->width : 1);
+	if (old_width > kept) {
+		// free the remaining trits
+		Trits* rest = it->left;
+		for (uintmax_t i=kept; i<old_width; i++) {
+			Trits* tmp = rest;
+			rest = rest->left;
+			free_trits(heap,tmp);
+		}
+		it->left = n->tail;
+		n->tail->right = it;
+	}
 }
 
-static inline void free_number(Number** ptr) {
+static inline void free_number(Heap* heap, Number** ptr) {
 	if (!ptr) return;
 	Number* n = *ptr;
 	Trits* it = n->tail;
 	for (uintmax_t i=0; i<n->width; i++) {
 		Trits* tmp = it;
 		it = it->left;
-		free(tmp);
+		free_trits(heap,tmp);
 	}
-	free(n);
+	pool_free(&heap->numbers,n);
 	(*ptr) = 0;
 }
 
@@ -245,7 +568,7 @@ static inline void update_unicode(Number* n) {
 		return; // no update needed
 	}
 	if (n->head != T0) {
-		n->unicode = -1;
+		n->unicode = (n->width && is_nl(n) ? -3 : -1);
 		return;
 	}
 	int32_t unicode = 0;
@@ -266,23 +589,23 @@ static inline void update_unicode(Number* n) {
 }
 
 // unicode-character to Number*
-static inline Number* to_number(int32_t symbol) {
+static inline Number* to_number(Heap* heap, int32_t symbol) {
 	if (symbol < 0) {
 		fprintf(stderr,"internal error: unexpected negative value\n");
 		exit(1);
 	}
-	Number* n = (Number*)malloc_or_die(sizeof(Number));
+	Number* n = alloc_number(heap);
 	n->head = T0;
 	n->width = 1;
 	n->memptr = 0; // to be computed
 	n->unicode = (symbol<0x110000?symbol:-1);
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
+	n->tail = alloc_trits(heap);
 	n->tail->left = n->tail;
 	n->tail->right = n->tail;
 	n->tail->trit = symbol % 3;
 	Trits* it = n->tail;
 	while (symbol /= 3) {
-		it->left = (Trits*)malloc_or_die(sizeof(Trits));
+		it->left = alloc_trits(heap);
 		it->left->right = it;
 		it = it->left;
 		it->trit = symbol % 3;
@@ -293,30 +616,74 @@ static inline Number* to_number(int32_t symbol) {
 	return n;
 }
 
-static inline Number* nl() {
-	Number* n = (Number*)malloc_or_die(sizeof(Number));
-	n->head = T2;
+static inline Number* address_to_number(Heap* heap, uintmax_t address) {
+	Number* n = alloc_number(heap);
+	n->head = T0;
 	n->width = 1;
 	n->memptr = 0; // to be computed
-	n->unicode = -1; // no unicode character
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
+	n->unicode = (address<0x110000?(int32_t)address:-1);
+	n->tail = alloc_trits(heap);
 	n->tail->left = n->tail;
 	n->tail->right = n->tail;
-	n->tail->trit = T1;
+	n->tail->trit = address % 3;
+	Trits* it = n->tail;
+	while (address /= 3) {
+		it->left = alloc_trits(heap);
+		it->left->right = it;
+		it = it->left;
+		it->trit = address % 3;
+		n->width++;
+	}
+	it->left = n->tail;
+	n->tail->right = it;
 	return n;
 }
 
-static inline Number* eof() {
-	Number* n = (Number*)malloc_or_die(sizeof(Number));
-	n->head = T2;
-	n->width = 1;
-	n->memptr = 0; // to be computed
-	n->unicode = -1; // no unicode character
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
-	n->tail->left = n->tail;
-	n->tail->right = n->tail;
-	n->tail->trit = T2;
-	return n;
+/*
+ * The numbers the in instruction stores in A: one for every byte value,
+ * newline (...21) and EOF (...22). They are built once, shared by all vms
+ * and never changed. A is mutated in place by rot and opr, so it cannot
+ * point to them; it becomes a copy reusing its own trits instead, and
+ * reading allocates nothing.
+ */
+
+#define INPUT_NL 256
+#define INPUT_EOF 257
+
+static Number input_numbers[258];
+static Trits input_trits[258][6];
+static pthread_once_t input_numbers_once = PTHREAD_ONCE_INIT;
+
+static void init_input_numbers(void) {
+	for (int i=0; i<258; i++) {
+		Number* n = &input_numbers[i];
+		Trits* t = input_trits[i];
+		int value = (i == INPUT_NL ? T1 : i == INPUT_EOF ? T2 : i);
+		n->head = (i < 256 ? T0 : T2);
+		n->width = 0;
+		n->memptr = 0; // to be computed
+		n->unicode = (i < 256 ? i : i == INPUT_NL ? -3 : -1);
+		do {
+			t[n->width++].trit = value % 3;
+		} while (value /= 3);
+		for (uintmax_t k=0; k<n->width; k++) {
+			t[k].left = &t[(k+1) % n->width];
+			t[k].right = &t[(k+n->width-1) % n->width];
+		}
+		n->tail = t;
+	}
+}
+
+static inline Number* byte_number(int32_t byte) {
+	return &input_numbers[byte];
+}
+
+static inline Number* nl(void) {
+	return &input_numbers[INPUT_NL];
+}
+
+static inline Number* eof(void) {
+	return &input_numbers[INPUT_EOF];
 }
 
 // correct values only for modul >= 2 and modul <= 29524
@@ -334,7 +701,7 @@ static inline int mod(Number* n, int modul) {
 	return result;
 }
 
-static inline void increment(Number* n) {
+static inline void increment(Heap* heap, Number* n) {
 	Trits* it = n->tail;
 	if (n->unicode >= 0 && n->unicode < 0x110000-1) {
 		n->unicode++;
@@ -355,7 +722,7 @@ static inline void increment(Number* n) {
 		return;
 	}
 	it = it->right;
-	it->left = (Trits*)malloc_or_die(sizeof(Trits));
+	it->left = alloc_trits(heap);
 	it->left->right = it;
 	it = it->left;
 	it->trit = n->head + 1;
@@ -364,11 +731,11 @@ static inline void increment(Number* n) {
 	n->width++;
 }
 
-static inline void xlat2(Number* n) {
+// returns 0 on success
+static inline int xlat2(Heap* heap, Number* n) {
 	update_unicode(n);
 	if (n->unicode < 33 || n->unicode > 126) {
-		fprintf(stderr,"cannot apply xlat2\n");
-		exit(1);
+		return 1;
 	}
 	const char* xlat2 = "5z]&gqtyfr$(we4{WP)H-Zn,[%\\3dL+Q;>U!pJS72FhOA1C" \
 			"B6v^=I_0/8|jsb9m<.TVac`uY*MK'X~xDl}REokN:#?G\"i@";
@@ -378,14 +745,15 @@ static inline void xlat2(Number* n) {
 	for (uintmax_t i=0; i<n->width; i++) {
 		Trits* tmp = it;
 		it = it->left;
-		free(tmp);
+		free_trits(heap,tmp);
 	}
 	n->tail = 0;
 	n->width = 0;
+	return 0;
 }
 
 // this is not done automatically to increase speed
-static inline void repair_number_after_xlat2(Number* n) {
+static inline void repair_number_after_xlat2(Heap* heap, Number* n) {
 	if (n->tail != 0 && n->width != 0) {
 		return;
 	}
@@ -395,13 +763,13 @@ static inline void repair_number_after_xlat2(Number* n) {
 	n->width = 1;
 	// create new trit sequence
 	int32_t symbol = n->unicode;
-	n->tail = (Trits*)malloc_or_die(sizeof(Trits));
+	n->tail = alloc_trits(heap);
 	n->tail->left = n->tail;
 	n->tail->right = n->tail;
 	n->tail->trit = symbol % 3;
 	Trits* it = n->tail;
 	while (symbol /= 3) {
-		it->left = (Trits*)malloc_or_die(sizeof(Trits));
+		it->left = alloc_trits(heap);
 		it->left->right = it;
 		it = it->left;
 		it->trit = symbol % 3;
@@ -412,10 +780,10 @@ static inline void repair_number_after_xlat2(Number* n) {
 	n->memptr = 0;
 }
 
-static inline void rotate_r(Number* n, uintmax_t rotwidth) {
+static inline void rotate_r(Heap* heap, Number* n, uintmax_t rotwidth) {
 	while (n->width < rotwidth) {
 		Trits* tmp = n->tail->right;
-		n->tail->right = (Trits*)malloc_or_die(sizeof(Trits));
+		n->tail->right = alloc_trits(heap);
 		n->tail->right->right = tmp;
 		tmp->left = n->tail->right;
 		n->tail->right->left = n->tail;
@@ -439,7 +807,7 @@ static inline uintmax_t get_real_width(Number* n) {
 	return real_width;
 }
 
-static inline void opr(Number* a, Number* d) {
+static inline void opr(Heap* heap, Number* a, Number* d) {
 	Trits* it_a = a->tail;
 	Trits* it_d = d->tail;
 	const int_fast8_t OPR[] = {
@@ -452,7 +820,7 @@ static inline void opr(Number* a, Number* d) {
 		pos++;
 		if (pos >= a->width && pos < d->width) {
 			// insert into a
-			it_a->left = (Trits*)malloc_or_die(sizeof(Trits));
+			it_a->left = alloc_trits(heap);
 			it_a->left->right = it_a;
 			it_a = it_a->left;
 			it_a->trit = a->head;
@@ -464,7 +832,7 @@ static inline void opr(Number* a, Number* d) {
 		}
 		if (pos >= d->width && pos < a->width) {
 			// insert into d
-			it_d->left = (Trits*)malloc_or_die(sizeof(Trits));
+			it_d->left = alloc_trits(heap);
 			it_d->left->right = it_d;
 			it_d = it_d->left;
 			it_d->trit = d->head;
@@ -482,315 +850,5368 @@ static inline void opr(Number* a, Number* d) {
 	d->unicode = -2; // to be computed
 }
 
-// returns unicode code point or -1 on EOF; exit(1) on error
-static inline int32_t read_utf8_character() {
-	int32_t in = (int32_t)getchar();
-	if (in == EOF) {
-		return -1;
-	}
-	if ((in & 0x80) == 0) {
-		return in;
+typedef struct DirtyCell {
+	MemCell* cell;
+	Number* addr; // copy of the address the cell was changed through
+} DirtyCell;
+
+// original value of a cell changed since the reset point; 0: uninitialized
+typedef struct UndoCell {
+	MemCell* cell;
+	Number* val;
+} UndoCell;
+
+// registers at the reset point
+typedef struct ResetPoint {
+	Number* a;
+	Number* c;
+	Number* d;
+	int pos;
+	uintmax_t step;
+	uintmax_t rotwidth;
+	uintmax_t max_wordwidth;
+	uint64_t random;
+} ResetPoint;
+
+// UTF-8 read from a file descriptor in blocks and decoded ahead
+typedef struct Decoder {
+	int fd;
+	unsigned char* in; // not yet decoded
+	size_t in_start;
+	size_t in_end;
+	int in_eof;
+	int raw; // every byte is a code point
+	int32_t* decoded;
+	size_t decoded_next;
+	size_t decoded_count;
+} Decoder;
+
+typedef struct Vm Vm;
+
+// indices of Vm.executed
+#define EXECUTED_JMP 0
+#define EXECUTED_OUT 1
+#define EXECUTED_IN 2
+#define EXECUTED_ROT 3
+#define EXECUTED_MOVD 4
+#define EXECUTED_OPR 5
+#define EXECUTED_HLT 6
+#define EXECUTED_COUNT 7
+
+struct Vm {
+	Heap heap;
+	MemoryTree memory[3];
+	Number* initial_values[6];
+	Number* a;
+	Number* c;
+	Number* d;
+	int pos;
+	uintmax_t step;
+	uintmax_t rotwidth;
+	uintmax_t max_wordwidth;
+	uintmax_t growth_slack;
+	uintmax_t growth_step;
+	uintmax_t growth_prob;
+	int det_growth;
+	uintmax_t growth_events; // times rotwidth has grown
+	uintmax_t executed[EXECUTED_COUNT]; // completed instructions by EXECUTED_*; nops are not counted
+	uint64_t random; // state of the random number generator
+	uintmax_t program_size; // number of cells read from the source
+	struct Stream* stream; // loader still running; 0: program loaded
+	void* image; // mapped program image; 0: none
+	size_t image_size;
+	MuIo io;
+	int32_t* input; // input fed while there is no read callback
+	size_t input_next;
+	size_t input_count;
+	size_t input_size;
+	int input_closed;
+	int32_t output; // last output while there is no write callback
+	Decoder stdin_decoder; // input of the default read callback
+	char* out; // output of the default write callback, not yet written
+	size_t out_len;
+	int flush; // MU_FLUSH_*; -1: decided on the first output
+	int raw; // the default I/O exchanges bytes instead of UTF-8
+	int status; // MU_RUNNING, MU_HALTED or MU_ERROR
+	char error[256];
+	// cells changed since the last checkpoint; only maintained if track_dirty is set
+	int track_dirty;
+	DirtyCell* dirty;
+	size_t dirty_count;
+	size_t dirty_size;
+	// cells changed since mu_snapshot; only maintained if track_undo is set
+	int track_undo;
+	ResetPoint reset;
+	UndoCell* undo;
+	size_t undo_count;
+	size_t undo_size;
+#ifdef PROFILE
+	Profile profile;
+#endif
+};
+
+// records an error; returns MU_ERROR
+static int vm_fail(Vm* vm, const char* format, ...) {
+	if (vm->status == MU_ERROR) {
+		return MU_ERROR; // keep the first error
 	}
-	if ((in & 0xE0) == 0xC0) {
-		int in2 = getchar();
-		if (in2 == EOF || (in2 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
+	va_list args;
+	va_start(args,format);
+	vsnprintf(vm->error,sizeof(vm->error),format,args);
+	va_end(args);
+	vm->status = MU_ERROR;
+	return MU_ERROR;
+}
+
+static inline void mark_dirty(Vm* vm, MemCell* cell, Number* addr) {
+	if (!vm->track_dirty || cell->dirty) return;
+	if (vm->dirty_count == vm->dirty_size) {
+		vm->dirty_size = (vm->dirty_size ? 2*vm->dirty_size : 1024);
+		vm->dirty = (DirtyCell*)realloc(vm->dirty, vm->dirty_size*sizeof(DirtyCell));
+		if (!vm->dirty) {
+			fprintf(stderr,"out of memory");
 			exit(1);
 		}
-		return (((in & 0x1F) << 6) | (in2 & 0x3F));
 	}
-	if ((in & 0xF0) == 0xE0) {
-		int32_t in2 = (int32_t)getchar();
-		if (in2 == EOF || (in2 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
-			exit(1);
-		}
-		int32_t in3 = (int32_t)getchar();
-		if (in3 == EOF || (in3 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
+	cell->dirty = 1;
+	vm->dirty[vm->dirty_count].cell = cell;
+	vm->dirty[vm->dirty_count].addr = clone_number(&vm->heap,addr);
+	vm->dirty_count++;
+}
+
+// logs the value of cell before its first change since the reset point
+static inline void save_cell(Vm* vm, MemCell* cell) {
+	if (!vm->track_undo || cell->saved) return;
+	if (vm->undo_count == vm->undo_size) {
+		vm->undo_size = (vm->undo_size ? 2*vm->undo_size : 1024);
+		vm->undo = (UndoCell*)realloc(vm->undo,vm->undo_size*sizeof(UndoCell));
+		if (!vm->undo) {
+			fprintf(stderr,"out of memory");
 			exit(1);
 		}
-		return (((in & 0x0F) << 12) | ((in2 & 0x3F) << 6) | (in3 & 0x3F));
 	}
-	if ((in & 0xF8) == 0xF0) {
-		int32_t in2 = (int32_t)getchar();
-		if (in2 == EOF || (in2 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
-			exit(1);
-		}
-		int32_t in3 = (int32_t)getchar();
-		if (in3 == EOF || (in3 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
-			exit(1);
-		}
-		int32_t in4 = (int32_t)getchar();
-		if (in4 == EOF || (in4 & 0xC0) != 0x80) {
-			fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
-			exit(1);
+	Number* val = 0;
+	if (cell->val) {
+		val = clone_number(&vm->heap,cell->val);
+		if (!cell->val->width) {
+			// cleared by xlat2
+			free_trits(&vm->heap,val->tail);
+			val->tail = 0;
 		}
-		return (((in & 0x07) << 18) | ((in2 & 0x3F) << 12) | ((in3 & 0x3F) << 6) | (in4 & 0x3F));
 	}
-	fprintf(stderr,"invalid utf-8 encoding while reading from stdin\n");
-	exit(1);
+	cell->saved = 1;
+	vm->undo[vm->undo_count].cell = cell;
+	vm->undo[vm->undo_count].val = val;
+	vm->undo_count++;
 }
 
-static inline void print_utf8(int32_t symbol) {
-	if (symbol < 0 || symbol >= 0x110000) {
-		fprintf(stderr,"invalid unicode codepoint\n");
-		exit(1);
-	}
+/*
+ * Default I/O: UTF-8 on stdin and stdout. The context is the vm. Input is
+ * read from stdin in large blocks, as far as available, and decoded ahead
+ * of the in instructions, 16 bytes at a time while they are ASCII. Output
+ * is encoded into a buffer of the vm and written with write(2) when the
+ * buffer is full, and depending on the flush policy after newlines and
+ * before input; mu_run flushes it when the program halts or fails. In
+ * raw mode (mu_set_raw) bytes take the place of the UTF-8 encodings.
+ */
+
+#define OUTPUT_BUFFER (64 << 10)
+#define INPUT_BUFFER (64 << 10)
+
+// writes the UTF-8 encoding of a code point to p; returns its length
+static int encode_utf8(int32_t symbol, char* p) {
 	if (symbol < 0x80) {
-		printf("%c",(char)symbol);
-		return;
-	}
-	if (symbol < 0x800) {
-		char first = (0xC0 | (symbol >> 6));
-		char second = (0x80 | (symbol & 0x3F));
-		printf("%c%c",first,second);
-		return;
+		p[0] = (char)symbol;
+		return 1;
 	}
 	if (symbol < 0x800) {
-		char first = (0xC0 | (symbol >> 6));
-		char second = (0x80 | (symbol & 0x3F));
-		printf("%c%c",first,second);
-		return;
+		p[0] = (char)(0xC0 | (symbol >> 6));
+		p[1] = (char)(0x80 | (symbol & 0x3F));
+		return 2;
 	}
 	if (symbol < 0x10000) {
-		char first = (0xE0 | (symbol >> 12));
-		char second = (0x80 | ((symbol >> 6) & 0x3F));
-		char third = (0x80 | (symbol & 0x3F));
-		printf("%c%c%c",first,second,third);
-		return;
+		p[0] = (char)(0xE0 | (symbol >> 12));
+		p[1] = (char)(0x80 | ((symbol >> 6) & 0x3F));
+		p[2] = (char)(0x80 | (symbol & 0x3F));
+		return 3;
 	}
-	char first = (0xF0 | (symbol >> 18));
-	char second = (0x80 | ((symbol >> 12) & 0x3F));
-	char third = (0x80 | ((symbol >> 6) & 0x3F));
-	char fourth = (0x80 | (symbol & 0x3F));
-	printf("%c%c%c%c",first,second,third,fourth);
+	p[0] = (char)(0xF0 | (symbol >> 18));
+	p[1] = (char)(0x80 | ((symbol >> 12) & 0x3F));
+	p[2] = (char)(0x80 | ((symbol >> 6) & 0x3F));
+	p[3] = (char)(0x80 | (symbol & 0x3F));
+	return 4;
 }
 
-int main(int argc, char* argv[]) {
-	Number* initial_values[6];
-	MemoryTree memory[3] = {{0,{0,0,0}},{0,{0,0,0}},{0,{0,0,0}}};
-	for (int_fast8_t i=0;i<3;i++) {
-		memory[i].cell = (MemCell*)malloc_or_die(sizeof(MemCell));
-		memory[i].cell->val = 0;
-		memory[i].cell->next = 0;
-	}
-	
-	Number* a = to_number(0);
-	Number* c = to_number(0);
-	Number* d = to_number(0);
-	uintmax_t max_wordwidth = 0;
-	srand(time(NULL));
-	uintmax_t rotwidth = 10 + rand()%6;
-	uintmax_t growth_slack = rand() % 6;
-	uintmax_t growth_step = 4 + rand() % 9;
-	uintmax_t growth_prob;
-	do {
-		growth_prob = rand();
-	} while (growth_prob < RAND_MAX/5 || growth_prob/4 > RAND_MAX/5);
-	int det_growth = rand()%2;
-
-	unsigned int result;
-	FILE* file;
-	if (argc < 2) {
-		// read program code from STDIN
-		file = stdin;
-	}else{
-		file = fopen(argv[1],"rb");
+// writes the buffered output to stdout; returns 0 on success
+static int flush_output(Vm* vm) {
+	size_t done = 0;
+	while (done < vm->out_len) {
+		ssize_t ret = write(STDOUT_FILENO,vm->out+done,vm->out_len-done);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			vm->out_len = 0;
+			return 1;
+		}
+		done += ret;
 	}
-	if (file == NULL) {
-		fprintf(stderr, "file not found: %s\n",argv[1]);
+	vm->out_len = 0;
+	return 0;
+}
+
+static int32_t invalid_utf8(Vm* vm) {
+	vm_fail(vm,"invalid utf-8 encoding while reading from stdin");
+	return MU_INPUT_ERROR;
+}
+
+// decodes a code point; returns the number of bytes used, 0 if more bytes
+// are needed or -1 on an invalid encoding
+static int decode_utf8(const unsigned char* p, size_t len, int32_t* symbol) {
+	int width;
+	int32_t value;
+	if ((p[0] & 0x80) == 0) {
+		*symbol = p[0];
 		return 1;
+	}else if ((p[0] & 0xE0) == 0xC0) {
+		width = 2;
+		value = p[0] & 0x1F;
+	}else if ((p[0] & 0xF0) == 0xE0) {
+		width = 3;
+		value = p[0] & 0x0F;
+	}else if ((p[0] & 0xF8) == 0xF0) {
+		width = 4;
+		value = p[0] & 0x07;
+	}else{
+		return -1;
 	}
+	for (int i=1; i<width; i++) {
+		if ((size_t)i >= len) {
+			return 0;
+		}
+		if ((p[i] & 0xC0) != 0x80) {
+			return -1;
+		}
+		value = (value << 6) | (p[i] & 0x3F);
+	}
+	*symbol = value;
+	return width;
+}
 
-	result = 0;
-	Number* init = to_number(0);
-	MemCell* prev = 0;
-	MemCell* prevprev = 0;
-	update_memptr(init,memory);
-	int pos = 0;
-	while (!feof(file)){
-		int instr;
-		char val;
-		result = fread(&val,1,1,file);
-		if (result > 1)
-			return 1;
-		if (result == 0) {
-			if (feof(file))
-				break;
-			else {
-				fprintf(stderr, "error: input error\n");
-				return 1;
+// decodes as much of the input read ahead as possible into d->decoded,
+// reading more if none is left; returns 0 if code points were decoded,
+// MU_EOF or MU_INPUT_ERROR
+static int32_t decode_input(Decoder* d) {
+	if (!d->in) {
+		d->in = (unsigned char*)malloc_or_die(INPUT_BUFFER);
+		d->decoded = (int32_t*)malloc_or_die(INPUT_BUFFER*sizeof(int32_t));
+	}
+	d->decoded_next = 0;
+	d->decoded_count = 0;
+	while (1) {
+		const unsigned char* p = d->in + d->in_start;
+		size_t len = d->in_end - d->in_start;
+		int32_t* out = d->decoded;
+		size_t i = 0;
+		size_t n = 0;
+		int invalid = 0;
+		while (i < len) {
+#ifdef __SSE2__
+			if (len - i >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+				if (!_mm_movemask_epi8(v)) {
+					// 16 ASCII characters
+					__m128i zero = _mm_setzero_si128();
+					__m128i lo = _mm_unpacklo_epi8(v,zero);
+					__m128i hi = _mm_unpackhi_epi8(v,zero);
+					_mm_storeu_si128((__m128i*)(out+n),_mm_unpacklo_epi16(lo,zero));
+					_mm_storeu_si128((__m128i*)(out+n+4),_mm_unpackhi_epi16(lo,zero));
+					_mm_storeu_si128((__m128i*)(out+n+8),_mm_unpacklo_epi16(hi,zero));
+					_mm_storeu_si128((__m128i*)(out+n+12),_mm_unpackhi_epi16(hi,zero));
+					i += 16;
+					n += 16;
+					continue;
+				}
+			}
+#endif
+			if (p[i] < 0x80 || d->raw) {
+				out[n++] = p[i++];
+				continue;
 			}
+			int32_t symbol;
+			int width = decode_utf8(p+i,len-i,&symbol);
+			if (width > 0) {
+				out[n++] = symbol;
+				i += width;
+				continue;
+			}
+			// an invalid or, at the end of the input, incomplete encoding
+			invalid = (width < 0 || d->in_eof);
+			break;
 		}
-		instr = ((int)val+pos)%94;
-		if (val == ' ' || val == '\t' || val == '\r'
-				|| val == '\n');
-		else if (val >= 33 && val < 127 &&
-				(instr == 4 || instr == 5 || instr == 23 || instr == 39
-					|| instr == 40 || instr == 62 || instr == 68
-					|| instr == 81)) {
-			init->memptr->val = to_number(val);
-			prevprev = prev;
-			prev = init->memptr;
-			increment(init);
-			update_memptr(init,memory);
-			if (!prev->next) {
-				prev->next = init->memptr;
-			}
-			pos++;
-			pos%=564;
-		}else{
-			fprintf(stderr, "invalid character\n");
-			return 1; //invalid characters are not accepted.
+		d->in_start += i;
+		if (n) {
+			d->decoded_count = n; // an error is reported once these are read
+			return 0;
+		}
+		if (invalid) {
+			return MU_INPUT_ERROR;
+		}
+		if (d->in_eof) {
+			return MU_EOF;
+		}
+		// keep an incomplete encoding and read more
+		len = d->in_end - d->in_start;
+		memmove(d->in,d->in+d->in_start,len);
+		d->in_start = 0;
+		d->in_end = len;
+		ssize_t ret = read(d->fd,d->in+len,INPUT_BUFFER-len);
+		if (ret > 0) {
+			d->in_end += ret;
+		}else if (ret == 0 || errno != EINTR) {
+			d->in_eof = 1; // like getchar, a read error ends the input
 		}
 	}
-	if (file != stdin) {
-		fclose(file);
-	}
-	if (!prevprev) {
-		fprintf(stderr, "error: not a valid Malbolge program\n");
-		return 1;
+}
+
+static void free_decoder(Decoder* d) {
+	free(d->in);
+	free(d->decoded);
+}
+
+// returns unicode code point, MU_EOF or MU_INPUT_ERROR
+static int32_t read_utf8_character(void* ctx) {
+	Vm* vm = (Vm*)ctx;
+	if (vm->out_len && vm->flush == MU_FLUSH_INPUT && flush_output(vm)) {
+		vm_fail(vm,"error: output error");
+		return MU_INPUT_ERROR;
 	}
-	pos %= 6;
-	for (; pos < 18; pos++) {
-		Number* m1 = clone_number(prev->val);
-		Number* m2 = clone_number(prevprev->val);
-		opr(m1, m2);
-		if (pos < 12) {
-			free_number(&m2);
-		}else{
-			update_unicode(m2);
-			update_memptr(m2,memory);
-			initial_values[pos-12] = m2;
+	Decoder* d = &vm->stdin_decoder;
+	if (d->decoded_next == d->decoded_count) {
+		int32_t ret = decode_input(d);
+		if (ret == MU_INPUT_ERROR) {
+			return invalid_utf8(vm);
 		}
-		update_unicode(m1);
-		init->memptr->val = m1;
-		prevprev = prev;
-		prev = init->memptr;
-		increment(init);
-		update_memptr(init,memory);
-		if (!prev->next) {
-			prev->next = init->memptr;
+		if (ret) {
+			return ret;
 		}
 	}
-	free_number(&init);
+	return d->decoded[d->decoded_next++];
+}
 
-	pos = 0;
-	update_memptr(c,memory);
-	update_memptr(d,memory);
-	int step = 1;
-	while (1) {
-		if (!c->memptr->val) {
-			c->memptr->val = clone_number(initial_values[pos%6]);
+// symbol is a valid code point; returns 0 on success
+static int print_utf8(void* ctx, int32_t symbol) {
+	Vm* vm = (Vm*)ctx;
+	if (!vm->out) {
+		vm->out = (char*)malloc_or_die(OUTPUT_BUFFER);
+		if (vm->flush < 0) {
+			vm->flush = (isatty(STDOUT_FILENO) ? MU_FLUSH_INPUT : MU_FLUSH_SIZE);
+		}
+	}
+	if (OUTPUT_BUFFER - vm->out_len < 4 && flush_output(vm)) {
+		return 1;
+	}
+	if (vm->raw) {
+		vm->out[vm->out_len++] = (char)symbol;
+	}else{
+		vm->out_len += encode_utf8(symbol,vm->out+vm->out_len);
+	}
+	if (symbol == '\n' && vm->flush >= MU_FLUSH_LINE) {
+		return flush_output(vm);
+	}
+	return 0;
+}
+
+/*
+ * Program images.
+ *
+ * An image holds the memory of a program right after loading and
+ * initialization: the trie, the cells, their values and the initial
+ * values. Everything is laid out exactly as in memory at address
+ * IMAGE_BASE, so loading maps the file copy-on-write at that address and
+ * needs no parsing. If that address range is taken, the image is mapped
+ * elsewhere and its pointers are relocated.
+ *
+ * The sections following the header are: trie nodes (the first three are
+ * the roots), cells, numbers, trits and a copy of the source. Cached next
+ * and memptr pointers are not stored. Images depend on the struct layout
+ * of the interpreter that wrote them.
+ *
+ * The objects of each section are in the order write_image visits them:
+ * the trie depth first from each root, each cell followed by its number
+ * and each number by its trits. Before an image is used, one pass checks
+ * that every pointer refers to the next object in that order, so a
+ * truncated, corrupt or planted image is rejected instead of followed.
+ */
+
+#define IMAGE_MAGIC 0x4d49554du // "MUIM"
+#define IMAGE_VERSION 3
+#define IMAGE_BASE ((uintptr_t)0x200000000000ull)
+#define IMAGE_DEPTH_MAX 128 // of the trie; addresses of a loaded program are far shorter
+
+typedef struct ImageHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sizes[4]; // sizeof MemoryTree, MemCell, Number and Trits
+	uint64_t base; // address the pointers in the image refer to
+	uint64_t size; // size of the whole file
+	uint64_t pos;
+	uint64_t program_size; // number of cells read from the source
+	uint64_t node_count;
+	uint64_t cell_count;
+	uint64_t number_count;
+	uint64_t trits_count;
+	uint64_t source_size;
+	uint64_t source_hash; // see hash_source
+	uint64_t initial_values[6];
+} ImageHeader;
+
+// returns 1 if the sections described by h fill exactly h->size bytes
+static int image_layout_valid(const ImageHeader* h) {
+	const uint64_t counts[4] = {h->node_count, h->cell_count, h->number_count, h->trits_count};
+	uint64_t end = sizeof(ImageHeader);
+	if (h->size < end || h->base > UINT64_MAX - h->size || h->pos >= 564 || h->node_count < 3) {
+		return 0;
+	}
+	for (int i=0; i<4; i++) {
+		if (counts[i] > (h->size - end)/h->sizes[i]) {
+			return 0;
 		}
-		update_unicode(c->memptr->val);
-		if (c->memptr->val->unicode < 33 || c->memptr->val->unicode > 126) {
-			fprintf(stderr,"error: invalid instruction in step %d\n",step);
+		end += counts[i]*h->sizes[i];
+	}
+	return h->source_size == h->size - end;
+}
+
+// walk of a mapped image in the order write_image built it
+typedef struct ImageCheck {
+	ImageHeader* h;
+	MemoryTree* nodes;
+	MemCell* cells;
+	Number* numbers;
+	Trits* trits;
+	uint64_t node; // index of the next object expected in each section
+	uint64_t cell;
+	uint64_t number;
+	uint64_t trit;
+} ImageCheck;
+
+// returns 1 if the stored pointer p refers to object, relative to the base of the image
+static inline int image_refers(ImageCheck* k, const void* p, const void* object) {
+	return (uint64_t)(uintptr_t)p == k->h->base + (uint64_t)((const char*)object - (const char*)k->h);
+}
+
+// the check_image_* functions return 0 if the object is valid
+
+static int check_image_number(ImageCheck* k, Number* p) {
+	if (!p) {
+		return 0;
+	}
+	if (k->number == k->h->number_count || !image_refers(k,p,&k->numbers[k->number])) {
+		return 1;
+	}
+	Number* n = &k->numbers[k->number++];
+	if (n->head < 0 || n->head > 2 || n->memptr || n->unicode < -3 || n->unicode > 0x10FFFF
+			|| n->width > k->h->trits_count - k->trit) {
+		return 1;
+	}
+	if (!n->width) {
+		return (n->tail != 0);
+	}
+	uintmax_t w = n->width;
+	Trits* first = &k->trits[k->trit];
+	if (!image_refers(k,n->tail,first)) {
+		return 1;
+	}
+	for (uintmax_t i=0; i<w; i++) {
+		if (first[i].trit < 0 || first[i].trit > 2 || !image_refers(k,first[i].left,&first[(i+1)%w])
+				|| !image_refers(k,first[i].right,&first[(i+w-1)%w])) {
 			return 1;
 		}
-		switch ((c->memptr->val->unicode+pos)%94) {
-			case 4: // jmp
-				if (!d->memptr->val) {
-					copy_number(c, initial_values[mod(d,6)]);
-				}else{
-					repair_number_after_xlat2(d->memptr->val);
-					update_memptr(d->memptr->val,memory);
-					copy_number(c, d->memptr->val);
-				}
-				update_memptr(c,memory);
-				pos = mod(c,564);
-				if (!c->memptr->val) {
-					c->memptr->val = clone_number(initial_values[pos%6]);
-				}
+	}
+	k->trit += w;
+	return 0;
+}
+
+static int check_image_cell(ImageCheck* k, MemCell* p) {
+	if (k->cell == k->h->cell_count || !image_refers(k,p,&k->cells[k->cell])) {
+		return 1;
+	}
+	MemCell* cell = &k->cells[k->cell++];
+	return cell->next || cell->dirty || cell->saved || check_image_number(k,cell->val);
+}
+
+static int check_image_tree(ImageCheck* k, MemoryTree* node, int_fast8_t head, int depth) {
+	if (depth > IMAGE_DEPTH_MAX) {
+		return 1;
+	}
+	for (int_fast8_t t=0; t<3; t++) {
+		if (!node->child[t]) {
+			continue;
+		}
+		if (k->node == k->h->node_count || !image_refers(k,node->child[t],&k->nodes[k->node])) {
+			return 1;
+		}
+		MemoryTree* child = &k->nodes[k->node++];
+		// a child reached by the head trit shares the cell of its parent
+		if (t == head ? child->cell != node->cell : check_image_cell(k,child->cell)) {
+			return 1;
+		}
+		if (check_image_tree(k,child,head,depth+1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// returns 0 if every pointer of a mapped image refers to the object write_image put there
+static int check_image(ImageHeader* h) {
+	ImageCheck k;
+	k.h = h;
+	k.nodes = (MemoryTree*)(h+1);
+	k.cells = (MemCell*)(k.nodes + h->node_count);
+	k.numbers = (Number*)(k.cells + h->cell_count);
+	k.trits = (Trits*)(k.numbers + h->number_count);
+	k.node = 3;
+	k.cell = 0;
+	k.number = 0;
+	k.trit = 0;
+	for (int_fast8_t i=0; i<3; i++) {
+		if (check_image_cell(&k,k.nodes[i].cell) || check_image_tree(&k,&k.nodes[i],i,0)) {
+			return 1;
+		}
+	}
+	for (int i=0; i<6; i++) {
+		Number* n = (Number*)(uintptr_t)h->initial_values[i];
+		if (!n || check_image_number(&k,n)) {
+			return 1;
+		}
+	}
+	return k.node != h->node_count || k.cell != h->cell_count
+			|| k.number != h->number_count || k.trit != h->trits_count;
+}
+
+static inline void* relocate(void* p, intptr_t delta) {
+	return p ? (void*)((char*)p + delta) : 0;
+}
+
+// adjusts all pointers of an image mapped at a different address than it was written for
+static void relocate_image(ImageHeader* h, intptr_t delta) {
+	MemoryTree* nodes = (MemoryTree*)(h+1);
+	MemCell* cells = (MemCell*)(nodes + h->node_count);
+	Number* numbers = (Number*)(cells + h->cell_count);
+	Trits* trits = (Trits*)(numbers + h->number_count);
+	for (uint64_t i=0; i<h->node_count; i++) {
+		nodes[i].cell = (MemCell*)relocate(nodes[i].cell,delta);
+		for (int_fast8_t t=0; t<3; t++) {
+			nodes[i].child[t] = (MemoryTree*)relocate(nodes[i].child[t],delta);
+		}
+	}
+	for (uint64_t i=0; i<h->cell_count; i++) {
+		cells[i].val = (Number*)relocate(cells[i].val,delta);
+	}
+	for (uint64_t i=0; i<h->number_count; i++) {
+		numbers[i].tail = (Trits*)relocate(numbers[i].tail,delta);
+	}
+	for (uint64_t i=0; i<h->trits_count; i++) {
+		trits[i].left = (Trits*)relocate(trits[i].left,delta);
+		trits[i].right = (Trits*)relocate(trits[i].right,delta);
+	}
+	for (int i=0; i<6; i++) {
+		h->initial_values[i] = (uint64_t)(uintptr_t)relocate((void*)(uintptr_t)h->initial_values[i],delta);
+	}
+	h->base += delta;
+}
+
+// maps an image; returns 0 if it is missing or incompatible, which is an error of vm unless quiet is set
+static ImageHeader* map_image(Vm* vm, const char* path, int quiet) {
+	int fd = open(path,O_RDONLY);
+	if (fd < 0) {
+		if (!quiet) {
+			vm_fail(vm,"image not found: %s",path);
+		}
+		return 0;
+	}
+	ImageHeader h;
+	struct stat st;
+	if (fstat(fd,&st) != 0 || pread(fd,&h,sizeof(h),0) != sizeof(h)
+			|| h.magic != IMAGE_MAGIC || h.version != IMAGE_VERSION
+			|| h.sizes[0] != sizeof(MemoryTree) || h.sizes[1] != sizeof(MemCell)
+			|| h.sizes[2] != sizeof(Number) || h.sizes[3] != sizeof(Trits)
+			|| h.size != (uint64_t)st.st_size || !image_layout_valid(&h)) {
+		if (!quiet) {
+			vm_fail(vm,"error: not a compatible image: %s",path);
+		}
+		close(fd);
+		return 0;
+	}
+	int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+	flags |= MAP_FIXED_NOREPLACE;
+#endif
+	char* mem = (char*)mmap((void*)(uintptr_t)h.base,h.size,PROT_READ|PROT_WRITE,flags,fd,0);
+	if (mem == MAP_FAILED) {
+		mem = (char*)mmap(0,h.size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+	}
+	close(fd);
+	if (mem == MAP_FAILED) {
+		if (!quiet) {
+			vm_fail(vm,"error: cannot map image %s",path);
+		}
+		return 0;
+	}
+	ImageHeader* mapped = (ImageHeader*)mem;
+	if (check_image(mapped)) {
+		munmap(mem,h.size);
+		if (!quiet) {
+			vm_fail(vm,"error: not a valid image: %s",path);
+		}
+		return 0;
+	}
+	if ((uintptr_t)mem != mapped->base) {
+		relocate_image(mapped,(intptr_t)((uintptr_t)mem - mapped->base));
+	}
+	return mapped;
+}
+
+// makes a mapped image the memory of a freshly initialized vm
+static void install_image(Vm* vm, ImageHeader* h) {
+	MemoryTree* roots = (MemoryTree*)(h+1);
+	for (int_fast8_t i=0; i<3; i++) {
+		vm->memory[i] = roots[i];
+	}
+	for (int i=0; i<6; i++) {
+		vm->initial_values[i] = (Number*)(uintptr_t)h->initial_values[i];
+	}
+	vm->program_size = h->program_size;
+	vm->pos = (int)h->pos;
+	vm->step = 1;
+	vm->image = h;
+	vm->image_size = h->size;
+	// the roots are copied to the vm
+	pool_add_live(&vm->heap.nodes,h->node_count-3);
+	pool_add_live(&vm->heap.cells,h->cell_count);
+	pool_add_live(&vm->heap.numbers,h->number_count);
+	pool_add_live(&vm->heap.trits,h->trits_count);
+	update_memptr(&vm->heap,vm->c,vm->memory);
+	update_memptr(&vm->heap,vm->d,vm->memory);
+}
+
+static void init_vm(Vm* vm, uint64_t seed) {
+	pthread_once(&input_numbers_once,init_input_numbers);
+	memset(vm,0,sizeof(Vm));
+	Heap* heap = &vm->heap;
+	for (int_fast8_t i=0;i<3;i++) {
+		vm->memory[i].cell = alloc_cell(heap);
+		vm->memory[i].cell->val = 0;
+		vm->memory[i].cell->next = 0;
+		vm->memory[i].cell->dirty = 0;
+		vm->memory[i].cell->saved = 0;
+	}
+	vm->a = to_number(heap,0);
+	vm->c = to_number(heap,0);
+	vm->d = to_number(heap,0);
+	vm->max_wordwidth = 0;
+	vm->random = seed;
+	vm->rotwidth = 10 + next_random(&vm->random)%6;
+	vm->growth_slack = next_random(&vm->random) % 6;
+	vm->growth_step = 4 + next_random(&vm->random) % 9;
+	do {
+		vm->growth_prob = next_random(&vm->random);
+	} while (vm->growth_prob < RANDOM_MAX/5 || vm->growth_prob/4 > RANDOM_MAX/5);
+	vm->det_growth = next_random(&vm->random)%2;
+	vm->io.read = read_utf8_character;
+	vm->io.write = print_utf8;
+	vm->io.ctx = vm;
+	vm->flush = -1;
+	vm->stdin_decoder.fd = STDIN_FILENO;
+	vm->status = MU_RUNNING;
+#ifdef PROFILE
+	vm->heap.profile = &vm->profile;
+	open_counters(&vm->profile);
+#endif
+}
+
+/*
+ * Program loader.
+ *
+ * The source is mapped (or read from stdin in large blocks), validated and
+ * stripped of whitespace in one pass, 16 bytes at a time where SSE2 is
+ * available. The cells of the program are then built in bulk: cells,
+ * numbers and trits live in contiguous arrays in address order, and the
+ * trie for addresses 0..n-1 is built in a single depth-first pass instead
+ * of one walk per cell.
+ */
+
+// valid instructions indexed by (character+position)%94
+static const unsigned char valid_instr[94] = {
+	[4] = 1, [5] = 1, [23] = 1, [39] = 1, [40] = 1, [62] = 1, [68] = 1, [81] = 1
+};
+
+static inline int is_whitespace(char val) {
+	return val == ' ' || val == '\t' || val == '\r' || val == '\n';
+}
+
+// number of instructions and invalid characters in src
+static size_t count_instructions(const char* src, size_t size) {
+	size_t i = 0;
+	size_t count = 0;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	for (; i+16 <= size; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,space),_mm_cmpeq_epi8(v,tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(v,cr),_mm_cmpeq_epi8(v,lf)));
+		count += 16 - __builtin_popcount(_mm_movemask_epi8(ws));
+	}
+#endif
+	for (; i<size; i++) {
+		count += !is_whitespace(src[i]);
+	}
+	return count;
+}
+
+// copies the instructions of src to code, given the number of instructions
+// before src; returns the number of instructions or -1 on an invalid character
+static ptrdiff_t scan_program(const char* src, size_t size, char* code, uintmax_t before) {
+	size_t i = 0;
+	ptrdiff_t count = 0;
+	int pos = (int)(before % 94);
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i lanes = _mm_setr_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	const __m128i m94 = _mm_set1_epi8(94);
+	for (; i+16 <= size; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,space),_mm_cmpeq_epi8(v,tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(v,cr),_mm_cmpeq_epi8(v,lf)));
+		if (_mm_movemask_epi8(ws) == 0) {
+			// signed compare: bytes above 127 are negative
+			__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v,_mm_set1_epi8(32)),_mm_cmplt_epi8(v,_mm_set1_epi8(127)));
+			// (v+pos+lane)%94 fits into a byte: at most 126+93+15
+			__m128i instr = _mm_add_epi8(_mm_add_epi8(v,_mm_set1_epi8((char)pos)),lanes);
+			instr = _mm_min_epu8(instr,_mm_sub_epi8(instr,m94));
+			instr = _mm_min_epu8(instr,_mm_sub_epi8(instr,m94));
+			__m128i valid = _mm_or_si128(
+					_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(instr,_mm_set1_epi8(4)),_mm_cmpeq_epi8(instr,_mm_set1_epi8(5))),
+						_mm_or_si128(_mm_cmpeq_epi8(instr,_mm_set1_epi8(23)),_mm_cmpeq_epi8(instr,_mm_set1_epi8(39)))),
+					_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(instr,_mm_set1_epi8(40)),_mm_cmpeq_epi8(instr,_mm_set1_epi8(62))),
+						_mm_or_si128(_mm_cmpeq_epi8(instr,_mm_set1_epi8(68)),_mm_cmpeq_epi8(instr,_mm_set1_epi8(81)))));
+			if (_mm_movemask_epi8(_mm_and_si128(ok,valid)) == 0xFFFF) {
+				_mm_storeu_si128((__m128i*)(code+count),v);
+				count += 16;
+				pos = (pos+16)%94;
+				continue;
+			}
+		}
+		// whitespace or a possibly invalid character in this block
+		for (size_t j=i; j<i+16; j++) {
+			char val = src[j];
+			if (is_whitespace(val));
+			else if (val >= 33 && val < 127 && valid_instr[((int)val+pos)%94]) {
+				code[count++] = val;
+				pos = (pos+1)%94;
+			}else{
+				return -1;
+			}
+		}
+	}
+#endif
+	for (; i<size; i++) {
+		char val = src[i];
+		if (is_whitespace(val));
+		else if (val >= 33 && val < 127 && valid_instr[((int)val+pos)%94]) {
+			code[count++] = val;
+			pos = (pos+1)%94;
+		}else{
+			return -1;
+		}
+	}
+	return count;
+}
+
+// subtrees left to be built by the parallel loader
+typedef struct Frontier {
+	uintmax_t split; // modulus at which subtrees are left to the workers
+	MemoryTree** nodes;
+	uintmax_t* residues;
+	size_t count;
+	size_t size;
+} Frontier;
+
+static void push_frontier(Frontier* f, MemoryTree* node, uintmax_t residue) {
+	if (f->count == f->size) {
+		f->size = (f->size ? 2*f->size : 64);
+		f->nodes = (MemoryTree**)realloc(f->nodes,f->size*sizeof(MemoryTree*));
+		f->residues = (uintmax_t*)realloc(f->residues,f->size*sizeof(uintmax_t));
+		if (!f->nodes || !f->residues) {
+			fprintf(stderr,"out of memory");
+			exit(1);
+		}
+	}
+	f->nodes[f->count] = node;
+	f->residues[f->count] = residue;
+	f->count++;
+}
+
+// builds the trie below node for the addresses below count that are
+// congruent to residue modulo power; subtrees from modulus frontier->split
+// on are left to the caller
+static void build_program_tree(Heap* heap, MemoryTree* node, MemCell* cells, uintmax_t count, uintmax_t residue, uintmax_t power, int top, Frontier* frontier) {
+	for (int_fast8_t t=0; t<3; t++) {
+		uintmax_t r = residue + t*power;
+		MemoryTree* child;
+		if (t == 0) {
+			// leading zeros: shares the cell of its parent; needed by longer addresses only
+			if (!top && (power > (UINTMAX_MAX-r)/3 || r + 3*power >= count)) {
+				continue;
+			}
+			child = alloc_node(heap);
+			child->cell = node->cell;
+		}else{
+			if (r >= count) {
+				continue;
+			}
+			child = alloc_node(heap);
+			child->cell = &cells[r];
+		}
+		child->child[0] = 0;
+		child->child[1] = 0;
+		child->child[2] = 0;
+		node->child[t] = child;
+		if (power <= UINTMAX_MAX/3) {
+			if (frontier && 3*power >= frontier->split) {
+				push_frontier(frontier,child,r);
+			}else{
+				build_program_tree(heap,child,cells,count,r,3*power,0,frontier);
+			}
+		}
+	}
+}
+
+// every instruction is a character between 33 and 126 with four or five trits
+static inline int instruction_width(char val) {
+	return (val < 81 ? 4 : 5);
+}
+
+// builds the value of an instruction using instruction_width(val) trits; returns the number of trits used
+static inline int build_instruction(Number* n, Trits* trits, char val) {
+	int32_t symbol = (int32_t)val;
+	int width = instruction_width(val);
+	n->head = T0;
+	n->width = width;
+	n->memptr = 0; // to be computed
+	n->unicode = symbol;
+	n->tail = trits;
+	for (int j=0; j<width; j++) {
+		trits[j].trit = symbol % 3;
+		symbol /= 3;
+		trits[j].left = &trits[(j+1)%width];
+		trits[j].right = &trits[(j+width-1)%width];
+	}
+	return width;
+}
+
+// builds the cells for the addresses from..to-1 of the program
+static void build_cells(Heap* heap, MemCell* cells, Number* numbers, const char* code, uintmax_t from, uintmax_t to, uintmax_t count) {
+	uintmax_t trits_count = 0;
+	for (uintmax_t i=from; i<to; i++) {
+		trits_count += instruction_width(code[i]);
+	}
+	Trits* trits = (Trits*)heap_block(heap,trits_count*sizeof(Trits));
+	pool_add_live(&heap->trits,trits_count);
+	for (uintmax_t i=from; i<to; i++) {
+		trits += build_instruction(&numbers[i],trits,code[i]);
+		cells[i].val = &numbers[i];
+		cells[i].next = (i+1 < count ? &cells[i+1] : 0);
+		cells[i].dirty = 0;
+		cells[i].saved = 0;
+	}
+}
+
+/*
+ * Parallel loader.
+ *
+ * The validity of a character depends on the number of instructions before
+ * it. The source is split into one chunk per thread; the threads count the
+ * instructions of their chunks, a prefix sum yields the number of
+ * instructions before each chunk, and then every thread validates its
+ * chunk and copies its instructions to their final place. An invalid
+ * character in any chunk fails the whole load, just like the serial
+ * loader stops at the first one. Cells are built per address range, and
+ * the trie below the top levels is built per subtree.
+ */
+
+// sources below this size are loaded by a single thread
+#define PARALLEL_LOAD_MIN (8 << 20)
+
+typedef struct LoadTask {
+	const char* src;
+	size_t size;
+	char* code;
+	const char* instructions; // code after scanning
+	uintmax_t before; // instructions before this chunk
+	uintmax_t count; // instructions in this chunk
+	int invalid;
+	MemCell* cells;
+	Number* numbers;
+	uintmax_t from;
+	uintmax_t to;
+	uintmax_t total;
+	Heap heap; // memory allocated by this task
+	Frontier* frontier;
+	size_t first_subtree;
+	size_t step_subtree;
+} LoadTask;
+
+static void* count_task(void* arg) {
+	LoadTask* t = (LoadTask*)arg;
+	t->count = count_instructions(t->src,t->size);
+	return 0;
+}
+
+static void* scan_task(void* arg) {
+	LoadTask* t = (LoadTask*)arg;
+	t->invalid = (scan_program(t->src,t->size,t->code+t->before,t->before) < 0);
+	return 0;
+}
+
+static void* build_cells_task(void* arg) {
+	LoadTask* t = (LoadTask*)arg;
+	build_cells(&t->heap,t->cells,t->numbers,t->instructions,t->from,t->to,t->total);
+	return 0;
+}
+
+static void* build_tree_task(void* arg) {
+	LoadTask* t = (LoadTask*)arg;
+	Frontier* f = t->frontier;
+	for (size_t i=t->first_subtree; i<f->count; i+=t->step_subtree) {
+		build_program_tree(&t->heap,f->nodes[i],t->cells,t->total,f->residues[i],f->split,0,0);
+	}
+	return 0;
+}
+
+static void run_tasks(LoadTask* tasks, int threads, void* (*fn)(void*)) {
+	pthread_t* ids = (pthread_t*)malloc_or_die(threads*sizeof(pthread_t));
+	for (int i=1; i<threads; i++) {
+		if (pthread_create(&ids[i],0,fn,&tasks[i]) != 0) {
+			fprintf(stderr,"error: cannot create thread\n");
+			exit(1);
+		}
+	}
+	fn(&tasks[0]);
+	for (int i=1; i<threads; i++) {
+		pthread_join(ids[i],0);
+	}
+	free(ids);
+}
+
+// copies the instructions of src to code using several threads; returns the number of instructions or -1 on an invalid character
+static ptrdiff_t scan_program_parallel(const char* src, size_t size, char* code, int threads) {
+	LoadTask* tasks = (LoadTask*)calloc(threads,sizeof(LoadTask));
+	if (!tasks) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	for (int i=0; i<threads; i++) {
+		size_t from = size/threads*i;
+		size_t to = (i == threads-1 ? size : size/threads*(i+1));
+		tasks[i].src = src + from;
+		tasks[i].size = to - from;
+		tasks[i].code = code;
+	}
+	run_tasks(tasks,threads,count_task);
+	uintmax_t before = 0;
+	for (int i=0; i<threads; i++) {
+		tasks[i].before = before;
+		before += tasks[i].count;
+	}
+	run_tasks(tasks,threads,scan_task);
+	ptrdiff_t count = (ptrdiff_t)before;
+	for (int i=0; i<threads; i++) {
+		if (tasks[i].invalid) {
+			count = -1;
+		}
+	}
+	free(tasks);
+	return count;
+}
+
+// creates the cells for the addresses 0..count-1 holding the given instructions
+static void build_program(Vm* vm, const char* code, uintmax_t count, int threads) {
+	MemCell* cells = (MemCell*)heap_block(&vm->heap,count*sizeof(MemCell));
+	Number* numbers = (Number*)heap_block(&vm->heap,count*sizeof(Number));
+	pool_add_live(&vm->heap.cells,count);
+	pool_add_live(&vm->heap.numbers,count);
+	vm->memory[0].cell = &cells[0];
+	if (threads <= 1) {
+		build_cells(&vm->heap,cells,numbers,code,0,count,count);
+		build_program_tree(&vm->heap,&vm->memory[0],cells,count,0,1,1,0);
+		return;
+	}
+	LoadTask* tasks = (LoadTask*)calloc(threads,sizeof(LoadTask));
+	if (!tasks) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	Frontier frontier = {1, 0, 0, 0, 0};
+	// enough subtrees to keep all threads busy
+	while (frontier.split < (uintmax_t)threads*27 && frontier.split < count) {
+		frontier.split *= 3;
+	}
+	for (int i=0; i<threads; i++) {
+		tasks[i].instructions = code;
+		tasks[i].cells = cells;
+		tasks[i].numbers = numbers;
+		tasks[i].from = count/threads*i;
+		tasks[i].to = (i == threads-1 ? count : count/threads*(i+1));
+		tasks[i].total = count;
+		tasks[i].frontier = &frontier;
+		tasks[i].first_subtree = i;
+		tasks[i].step_subtree = threads;
+	}
+	run_tasks(tasks,threads,build_cells_task);
+	build_program_tree(&vm->heap,&vm->memory[0],cells,count,0,1,1,&frontier);
+	run_tasks(tasks,threads,build_tree_task);
+	for (int i=0; i<threads; i++) {
+		merge_heap(&vm->heap,&tasks[i].heap);
+	}
+	free(frontier.nodes);
+	free(frontier.residues);
+	free(tasks);
+}
+
+// initializes the memory after the program of the given size and the
+// initial values from the last two instructions; the cells behind the
+// program must not be initialized yet
+static void fill_memory(Vm* vm, Number* last2, Number* last, MemCell* last_cell, uintmax_t count) {
+	Heap* heap = &vm->heap;
+	MemoryTree* memory = vm->memory;
+	Number* prevprev = last2;
+	Number* prev = last;
+	MemCell* prev_cell;
+	Number* init = address_to_number(heap,count);
+	update_memptr(heap,init,memory);
+	if (last_cell) {
+		last_cell->next = init->memptr;
+	}
+	int pos = (int)(count % 6);
+	for (; pos < 18; pos++) {
+		Number* m1 = clone_number(heap,prev);
+		Number* m2 = clone_number(heap,prevprev);
+		opr(heap,m1, m2);
+		if (pos < 12) {
+			free_number(heap,&m2);
+		}else{
+			update_unicode(m2);
+			update_memptr(heap,m2,memory);
+			vm->initial_values[pos-12] = m2;
+		}
+		update_unicode(m1);
+		init->memptr->val = m1;
+		prevprev = prev;
+		prev = m1;
+		prev_cell = init->memptr;
+		increment(heap,init);
+		update_memptr(heap,init,memory);
+		if (!prev_cell->next) {
+			prev_cell->next = init->memptr;
+		}
+	}
+	free_number(heap,&init);
+}
+
+// returns 0 on success
+static int load_source(Vm* vm, const char* src, size_t size, int threads) {
+	Heap* heap = &vm->heap;
+	MemoryTree* memory = vm->memory;
+#ifdef PROFILE
+	ProfileMark mark;
+	profile_mark(&vm->profile,&mark);
+#endif
+	char* code = (char*)malloc_or_die(size ? size : 1);
+	if (size < PARALLEL_LOAD_MIN) {
+		threads = 1;
+	}
+	ptrdiff_t count = (threads > 1 ? scan_program_parallel(src,size,code,threads)
+			: scan_program(src,size,code,0));
+	if (count < 0) {
+		free(code);
+		return vm_fail(vm,"invalid character"); //invalid characters are not accepted.
+	}
+	if (count < 2) {
+		free(code);
+		return vm_fail(vm,"error: not a valid Malbolge program");
+	}
+	build_program(vm,code,(uintmax_t)count,threads);
+	free(code);
+	vm->program_size = (uintmax_t)count;
+
+	// the cells of the program are contiguous in address order
+	MemCell* cells = memory[0].cell;
+#ifdef PROFILE
+	Profile* p = &vm->profile;
+	p->cells = cells;
+	p->cell_count = (uintmax_t)count;
+	p->cell_counts = (uintmax_t*)calloc(count,sizeof(uintmax_t));
+	p->offsets = (size_t*)malloc_or_die(count*sizeof(size_t));
+	if (!p->cell_counts) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	for (size_t i=0, n=0; i<size; i++) {
+		if (!is_whitespace(src[i])) {
+			p->offsets[n++] = i;
+		}
+	}
+	profile_phase(p,PROFILE_LOAD,&mark);
+#endif
+	fill_memory(vm,cells[count-2].val,cells[count-1].val,&cells[count-1],(uintmax_t)count);
+#ifdef PROFILE
+	profile_phase(p,PROFILE_FILL,&mark);
+#endif
+	vm->pos = 0;
+	vm->step = 1;
+	update_memptr(heap,vm->c,memory);
+	update_memptr(heap,vm->d,memory);
+	return 0;
+}
+
+/*
+ * Streaming start.
+ *
+ * A loader thread reads and validates the program in growing blocks and
+ * publishes the values of the instructions while the interpreter already
+ * runs. The interpreter installs a program cell the first time it finds
+ * it uninitialized, waiting for the loader if that cell is not loaded yet.
+ * The memory behind the program and the initial values depend on the last
+ * two instructions; the interpreter fills them in once it needs any of
+ * them, after the loader has finished. A load error is reported as soon
+ * as the interpreter waits for the loader or halts, so some output may
+ * precede it.
+ */
+
+#define STREAM_SEGMENT_BITS 16
+#define STREAM_SEGMENT (1 << STREAM_SEGMENT_BITS)
+#define STREAM_SEGMENTS (1 << 24)
+#define STREAM_BLOCK_MIN (64 << 10)
+#define STREAM_BLOCK_MAX (4 << 20)
+
+typedef struct Stream {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Number** segments; // values of the instructions; STREAM_SEGMENT each
+	uintmax_t loaded; // instructions available to the interpreter
+	int done; // 1: loaded; -1: invalid character; -2: input error
+	char last[2]; // the last two instructions
+	int filled; // memory behind the program initialized
+	int joined;
+	Heap heap; // values of the instructions; owned by the loader until it has finished
+} Stream;
+
+static void* stream_loader(void* arg) {
+	Stream* st = (Stream*)arg;
+	size_t block = STREAM_BLOCK_MIN;
+	char* buf = (char*)malloc_or_die(STREAM_BLOCK_MAX);
+	char* code = (char*)malloc_or_die(STREAM_BLOCK_MAX);
+	uintmax_t count = 0;
+	int status = 1;
+	while (1) {
+		ssize_t len = read(st->fd,buf,block);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			status = -2;
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+		ptrdiff_t n = scan_program(buf,len,code,count);
+		if (n < 0) {
+			status = -1;
+			break;
+		}
+		Trits* trits = (Trits*)heap_block(&st->heap,5*n*sizeof(Trits));
+		for (ptrdiff_t i=0; i<n; i++) {
+			uintmax_t addr = count+i;
+			if ((addr >> STREAM_SEGMENT_BITS) >= STREAM_SEGMENTS) {
+				fprintf(stderr,"out of memory");
+				exit(1);
+			}
+			Number** segment = &st->segments[addr >> STREAM_SEGMENT_BITS];
+			if (!*segment) {
+				*segment = (Number*)heap_block(&st->heap,STREAM_SEGMENT*sizeof(Number));
+			}
+			trits += build_instruction(&(*segment)[addr & (STREAM_SEGMENT-1)],trits,code[i]);
+			st->last[0] = st->last[1];
+			st->last[1] = code[i];
+		}
+		count += n;
+		pthread_mutex_lock(&st->lock);
+		__atomic_store_n(&st->loaded,count,__ATOMIC_RELEASE);
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if (block < STREAM_BLOCK_MAX) {
+			block *= 2;
+		}
+	}
+	free(buf);
+	free(code);
+	pthread_mutex_lock(&st->lock);
+	st->done = status;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+	return 0;
+}
+
+static Stream* start_stream(int fd) {
+	Stream* st = (Stream*)calloc(1,sizeof(Stream));
+	Number** segments = (Number**)calloc(STREAM_SEGMENTS,sizeof(Number*));
+	if (!st || !segments) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	st->fd = fd;
+	st->segments = segments;
+	pthread_mutex_init(&st->lock,0);
+	pthread_cond_init(&st->cond,0);
+	if (pthread_create(&st->thread,0,stream_loader,st) != 0) {
+		fprintf(stderr,"error: cannot create thread\n");
+		exit(1);
+	}
+	return st;
+}
+
+// waits until the instruction at addr is loaded or loading has finished; returns the number of loaded instructions
+static uintmax_t wait_for_stream(Stream* st, uintmax_t addr) {
+	uintmax_t loaded = __atomic_load_n(&st->loaded,__ATOMIC_ACQUIRE);
+	if (addr < loaded) {
+		return loaded;
+	}
+	pthread_mutex_lock(&st->lock);
+	while (st->loaded <= addr && !st->done) {
+		pthread_cond_wait(&st->cond,&st->lock);
+	}
+	loaded = st->loaded;
+	pthread_mutex_unlock(&st->lock);
+	return loaded;
+}
+
+static void join_stream(Stream* st) {
+	if (!st->joined) {
+		pthread_join(st->thread,0);
+		st->joined = 1;
+	}
+}
+
+// waits for the loader and initializes the memory behind the program;
+// returns 0 on success. After a load error the memory is filled anyway so
+// that the current step can complete before the vm stops.
+static int finish_stream(Vm* vm) {
+	Stream* st = vm->stream;
+	if (st->filled) {
+		return vm->status == MU_ERROR;
+	}
+	join_stream(st);
+	if (st->done == -1) {
+		vm_fail(vm,"invalid character");
+	}else if (st->done == -2) {
+		vm_fail(vm,"error: input error");
+	}else if (st->loaded < 2) {
+		vm_fail(vm,"error: not a valid Malbolge program");
+	}
+	vm->program_size = st->loaded;
+	// the cells of the last two instructions may have changed already
+	Heap* heap = &vm->heap;
+	Number* last2 = to_number(heap,st->last[0]);
+	Number* last = to_number(heap,st->last[1]);
+	fill_memory(vm,last2,last,0,st->loaded);
+	free_number(heap,&last2);
+	free_number(heap,&last);
+	st->filled = 1;
+	return vm->status == MU_ERROR;
+}
+
+// value of a number if it is a non-negative integer; returns 0 if not or too large
+static inline int number_to_address(Number* n, uintmax_t* addr) {
+	if (n->head != T0) {
+		return 0;
+	}
+	uintmax_t value = 0;
+	uintmax_t factor = 1;
+	Trits* it = n->tail;
+	for (uintmax_t i=0; i<n->width; i++) {
+		if (it->trit) {
+			if (factor == 0 || factor > (UINTMAX_MAX-value)/it->trit) {
+				return 0;
+			}
+			value += factor*it->trit;
+		}
+		factor = (factor <= UINTMAX_MAX/3 ? factor*3 : 0);
+		it = it->left;
+	}
+	*addr = value;
+	return 1;
+}
+
+// called for an uninitialized cell at address reg while streaming; returns
+// 1 if the cell holds a value now, 0 if it is to be set from the initial values
+static int stream_cell(Vm* vm, Number* reg) {
+	Stream* st = vm->stream;
+	if (!st) {
+		return 0;
+	}
+	uintmax_t addr;
+	if (number_to_address(reg,&addr)) {
+		uintmax_t loaded = wait_for_stream(st,addr);
+		if (addr < loaded) {
+			reg->memptr->val = &st->segments[addr >> STREAM_SEGMENT_BITS][addr & (STREAM_SEGMENT-1)];
+			// from now on the number belongs to the vm
+			pool_add_live(&vm->heap.numbers,1);
+			pool_add_live(&vm->heap.trits,reg->memptr->val->width);
+			return 1;
+		}
+	}
+	finish_stream(vm);
+	return (reg->memptr->val != 0);
+}
+
+/*
+ * Interpreter.
+ */
+
+static inline int step(Vm* vm) {
+	Heap* heap = &vm->heap;
+	MemoryTree* memory = vm->memory;
+	Number** initial_values = vm->initial_values;
+	Number* c = vm->c;
+	Number* d = vm->d;
+	MemCell* prev;
+	int result = MU_RUNNING;
+	if (!c->memptr->val && !stream_cell(vm,c)) {
+		save_cell(vm,c->memptr);
+		c->memptr->val = clone_number(heap,initial_values[vm->pos%6]);
+		mark_dirty(vm,c->memptr,c);
+	}
+	update_unicode(c->memptr->val);
+	if (c->memptr->val->unicode < 33 || c->memptr->val->unicode > 126) {
+		return vm_fail(vm,"error: invalid instruction in step %ju",vm->step);
+	}
+#ifdef PROFILE
+	Profile* p = &vm->profile;
+	p->ops[(c->memptr->val->unicode+vm->pos)%94]++;
+	uintptr_t cell = (uintptr_t)(c->memptr - p->cells);
+	if (p->cells && c->memptr >= p->cells && cell < p->cell_count) {
+		p->cell_counts[cell]++;
+	}else{
+		p->outside++;
+	}
+	profile_width(p->widths[0],vm->a->width);
+	profile_width(p->widths[1],c->width);
+	profile_width(p->widths[2],d->width);
+#endif
+	switch ((c->memptr->val->unicode+vm->pos)%94) {
+		case 4: // jmp
+			if (!d->memptr->val && !stream_cell(vm,d)) {
+				copy_number(heap,c, initial_values[mod(d,6)]);
+			}else{
+				repair_number_after_xlat2(heap,d->memptr->val);
+				update_memptr(heap,d->memptr->val,memory);
+				copy_number(heap,c, d->memptr->val);
+			}
+			update_memptr(heap,c,memory);
+			vm->pos = mod(c,564);
+			if (!c->memptr->val && !stream_cell(vm,c)) {
+				save_cell(vm,c->memptr);
+				c->memptr->val = clone_number(heap,initial_values[vm->pos%6]);
+				mark_dirty(vm,c->memptr,c);
+			}
+			vm->executed[EXECUTED_JMP]++;
+			break;
+		case 5: // out
+		{
+			update_unicode(vm->a);
+			int32_t symbol = vm->a->unicode;
+			if (symbol < 0) {
+				// ...21 is a newline; a checkpoint may hold it with -1
+				if (symbol != -3 && !is_nl(vm->a)) {
+					return vm_fail(vm,"invalid unicode codepoint");
+				}
+				symbol = '\n';
+			}
+			if (!vm->io.write) {
+				vm->output = symbol;
+				result = MU_HAVE_OUTPUT;
+			}else if (vm->io.write(vm->io.ctx,symbol)) {
+				return vm_fail(vm,"error: output error");
+			}
+			vm->executed[EXECUTED_OUT]++;
+			break;
+		}
+		case 23: // in
+		{
+			int32_t in;
+			if (vm->io.read) {
+				in = vm->io.read(vm->io.ctx);
+			}else if (vm->input_next < vm->input_count) {
+				in = vm->input[vm->input_next++];
+			}else if (vm->input_closed) {
+				in = MU_EOF;
+			}else{
+				return MU_NEED_INPUT; // nothing changed yet; the instruction is executed again
+			}
+			if (in < MU_EOF) {
+				if (in == MU_WOULD_BLOCK) {
+					return MU_NEED_INPUT;
+				}
+				return vm_fail(vm,"error: input error");
+			}
+			if (in == MU_EOF) {
+				copy_number(heap,vm->a,eof());
+			}else if (in == '\n') {
+				copy_number(heap,vm->a,nl());
+			}else if (in < 256) {
+				copy_number(heap,vm->a,byte_number(in));
+			}else{
+				free_number(heap,&vm->a);
+				vm->a = to_number(heap,in);
+			}
+			vm->executed[EXECUTED_IN]++;
+			break;
+		}
+		case 39: // rot
+			// a streamed value is installed first, so the undo log holds a copy of
+			// it rather than 0, and a reset never frees the value of the loader
+			if (!d->memptr->val) {
+				stream_cell(vm,d);
+			}
+			save_cell(vm,d->memptr);
+			if (!d->memptr->val) {
+				d->memptr->val = clone_number(heap,initial_values[mod(d,6)]);
+			}else{
+				repair_number_after_xlat2(heap,d->memptr->val);
+			}
+			mark_dirty(vm,d->memptr,d);
+			rotate_r(heap,d->memptr->val, vm->rotwidth);
+			copy_number(heap,vm->a,d->memptr->val);
+			vm->executed[EXECUTED_ROT]++;
+			break;
+		case 40: // movd
+			if (!d->memptr->val && !stream_cell(vm,d)) {
+				copy_number(heap,d,initial_values[mod(d,6)]);
+			}else{
+				repair_number_after_xlat2(heap,d->memptr->val);
+				update_memptr(heap,d->memptr->val,memory);
+				copy_number(heap,d, d->memptr->val);
+			}
+			update_memptr(heap,d,memory);
+			// check rotwidth
+			if (d->width > vm->max_wordwidth) {
+				uintmax_t w = get_real_width(d);
+				if (w > vm->max_wordwidth) {
+					uintmax_t rotwidth = vm->rotwidth;
+					vm->max_wordwidth = w;
+					if (vm->det_growth) {
+						vm->rotwidth = det_growth_policy(vm->max_wordwidth, vm->rotwidth, vm->growth_step, vm->growth_slack);
+					}else{
+						vm->rotwidth = nondet_growth_policy(vm->max_wordwidth, vm->rotwidth, vm->growth_prob, vm->growth_slack, &vm->random);
+					}
+					if (!vm->rotwidth) {
+						return vm_fail(vm,"maximal supported rotation width exceeded");
+					}
+					vm->growth_events += (vm->rotwidth > rotwidth);
+				}
+			}
+			vm->executed[EXECUTED_MOVD]++;
+			break;
+		case 62: // opr
+			// installed first as in rot
+			if (!d->memptr->val) {
+				stream_cell(vm,d);
+			}
+			save_cell(vm,d->memptr);
+			if (!d->memptr->val) {
+				d->memptr->val = clone_number(heap,initial_values[mod(d,6)]);
+			}else{
+				repair_number_after_xlat2(heap,d->memptr->val);
+			}
+			mark_dirty(vm,d->memptr,d);
+			opr(heap,vm->a,d->memptr->val);
+			vm->executed[EXECUTED_OPR]++;
+			break;
+		case 81: // hlt
+			if (vm->stream && finish_stream(vm)) {
+				return MU_ERROR;
+			}
+			vm->executed[EXECUTED_HLT]++;
+			vm->status = MU_HALTED;
+			return MU_HALTED;
+		case 68:
+		default: // nop
+			break;
+	}
+	save_cell(vm,c->memptr);
+	mark_dirty(vm,c->memptr,c);
+	if (xlat2(heap,c->memptr->val)) {
+		return vm_fail(vm,"cannot apply xlat2");
+	}
+	prev = c->memptr;
+	increment(heap,c);
+	update_memptr(heap,c,memory);
+	if (!prev->next) {
+		prev->next = c->memptr;
+	}
+	vm->pos++;
+	vm->pos %= 564;
+	prev = d->memptr;
+	increment(heap,d);
+	update_memptr(heap,d,memory);
+	if (!prev->next) {
+		prev->next = d->memptr;
+	}
+	vm->step++;
+	if (vm->status != MU_RUNNING) {
+		return vm->status; // a failed streaming load completes the step
+	}
+	return result;
+}
+
+MuVm* mu_create(uint64_t seed) {
+	Vm* vm = (Vm*)malloc_or_die(sizeof(Vm));
+	init_vm(vm,seed);
+	return vm;
+}
+
+void mu_destroy(MuVm* vm) {
+	Stream* st = vm->stream;
+	if (st) {
+		join_stream(st);
+		pthread_mutex_destroy(&st->lock);
+		pthread_cond_destroy(&st->cond);
+		free(st->segments);
+		free_heap(&st->heap);
+		free(st);
+	}
+	if (vm->image) {
+		munmap(vm->image,vm->image_size);
+	}
+	flush_output(vm);
+	free(vm->out);
+	free_decoder(&vm->stdin_decoder);
+	free(vm->dirty);
+	free(vm->undo);
+	free(vm->input);
+#ifdef PROFILE
+	free(vm->profile.cell_counts);
+	free(vm->profile.offsets);
+	close_counters(&vm->profile);
+#endif
+	free_heap(&vm->heap);
+	free(vm);
+}
+
+void mu_set_io(MuVm* vm, const MuIo* io) {
+	vm->io = *io;
+}
+
+void mu_set_flush(MuVm* vm, int policy) {
+	vm->flush = policy;
+}
+
+void mu_set_raw(MuVm* vm, int raw) {
+	vm->raw = raw;
+	vm->stdin_decoder.raw = raw;
+}
+
+int mu_load(MuVm* vm, const char* source, size_t size, int threads) {
+	return load_source(vm,source,size,threads);
+}
+
+int mu_load_image(MuVm* vm, const char* path) {
+#ifdef PROFILE
+	ProfileMark mark;
+	profile_mark(&vm->profile,&mark);
+#endif
+	ImageHeader* h = map_image(vm,path,0);
+	if (!h) {
+		return MU_ERROR;
+	}
+	install_image(vm,h);
+#ifdef PROFILE
+	profile_phase(&vm->profile,PROFILE_LOAD,&mark);
+#endif
+	return 0;
+}
+
+int mu_load_stream(MuVm* vm, int fd) {
+	vm->stream = start_stream(fd);
+	vm->pos = 0;
+	vm->step = 1;
+	update_memptr(&vm->heap,vm->c,vm->memory);
+	update_memptr(&vm->heap,vm->d,vm->memory);
+	return 0;
+}
+
+int mu_step(MuVm* vm) {
+	return mu_run(vm,1);
+}
+
+int mu_run(MuVm* vm, uintmax_t budget) {
+	if (vm->status != MU_RUNNING) {
+		return vm->status;
+	}
+#ifdef PROFILE
+	ProfileMark mark;
+	profile_mark(&vm->profile,&mark);
+#endif
+	int status = MU_BUDGET_EXHAUSTED;
+	while (budget) {
+		budget--;
+		status = step(vm);
+		if (status != MU_RUNNING) {
+			if ((status == MU_HALTED || status == MU_ERROR) && flush_output(vm)) {
+				status = vm_fail(vm,"error: output error");
+			}
+			break;
+		}
+	}
+#ifdef PROFILE
+	profile_phase(&vm->profile,PROFILE_RUN,&mark);
+#endif
+	return status;
+}
+
+void mu_feed(MuVm* vm, const int32_t* symbols, size_t count) {
+	if (vm->input_next == vm->input_count) {
+		vm->input_next = 0;
+		vm->input_count = 0;
+	}
+	if (vm->input_count + count > vm->input_size) {
+		// drop the consumed input before growing
+		vm->input_count -= vm->input_next;
+		memmove(vm->input,vm->input+vm->input_next,vm->input_count*sizeof(int32_t));
+		vm->input_next = 0;
+		while (vm->input_count + count > vm->input_size) {
+			vm->input_size = (vm->input_size ? 2*vm->input_size : 256);
+		}
+		vm->input = (int32_t*)realloc(vm->input,vm->input_size*sizeof(int32_t));
+		if (!vm->input) {
+			fprintf(stderr,"out of memory");
+			exit(1);
+		}
+	}
+	memcpy(vm->input+vm->input_count,symbols,count*sizeof(int32_t));
+	vm->input_count += count;
+}
+
+// drops the undo log, keeping the current values
+static void forget_undo(Vm* vm) {
+	for (size_t i=0; i<vm->undo_count; i++) {
+		vm->undo[i].cell->saved = 0;
+		if (vm->undo[i].val) {
+			free_number(&vm->heap,&vm->undo[i].val);
+		}
+	}
+	vm->undo_count = 0;
+}
+
+int mu_snapshot(MuVm* vm) {
+	if (vm->stream && finish_stream(vm)) {
+		return MU_ERROR;
+	}
+	if (vm->status != MU_RUNNING) {
+		return vm->status;
+	}
+	Heap* heap = &vm->heap;
+	forget_undo(vm);
+	ResetPoint* r = &vm->reset;
+	if (vm->track_undo) {
+		free_number(heap,&r->a);
+		free_number(heap,&r->c);
+		free_number(heap,&r->d);
+	}
+	r->a = clone_number(heap,vm->a);
+	r->c = clone_number(heap,vm->c);
+	r->d = clone_number(heap,vm->d);
+	r->pos = vm->pos;
+	r->step = vm->step;
+	r->rotwidth = vm->rotwidth;
+	r->max_wordwidth = vm->max_wordwidth;
+	r->random = vm->random;
+	vm->track_undo = 1;
+	return 0;
+}
+
+int mu_reset(MuVm* vm) {
+	if (!vm->track_undo) {
+		return vm_fail(vm,"error: no snapshot to reset to");
+	}
+	Heap* heap = &vm->heap;
+	// trie nodes and next pointers added since are kept; they only cache addresses
+	for (size_t i=0; i<vm->undo_count; i++) {
+		MemCell* cell = vm->undo[i].cell;
+		if (cell->val) {
+			free_number(heap,&cell->val);
+		}
+		cell->val = vm->undo[i].val;
+		cell->saved = 0;
+	}
+	vm->undo_count = 0;
+	ResetPoint* r = &vm->reset;
+	copy_number(heap,vm->a,r->a);
+	copy_number(heap,vm->c,r->c);
+	copy_number(heap,vm->d,r->d);
+	vm->pos = r->pos;
+	vm->step = r->step;
+	vm->rotwidth = r->rotwidth;
+	vm->max_wordwidth = r->max_wordwidth;
+	vm->random = r->random;
+	vm->input_next = 0;
+	vm->input_count = 0;
+	vm->input_closed = 0;
+	vm->output = 0;
+	vm->status = MU_RUNNING;
+	vm->error[0] = 0;
+	// the heap keeps its blocks, so only the object counts show the peak of the next run
+	Pool* pools[4] = {&heap->trits, &heap->numbers, &heap->cells, &heap->nodes};
+	for (int i=0; i<4; i++) {
+		pools[i]->peak = pools[i]->live;
+	}
+	return 0;
+}
+
+void mu_close_input(MuVm* vm) {
+	vm->input_closed = 1;
+}
+
+int32_t mu_output(const MuVm* vm) {
+	return vm->output;
+}
+
+uintmax_t mu_steps(const MuVm* vm) {
+	return vm->step;
+}
+
+size_t mu_memory(const MuVm* vm) {
+	return vm->heap.size + vm->image_size;
+}
+
+void mu_memory_stats(const MuVm* vm, MuMemoryStats* stats) {
+	const Pool* pools[4] = {&vm->heap.trits, &vm->heap.numbers, &vm->heap.cells, &vm->heap.nodes};
+	static const size_t sizes[4] = {sizeof(Trits), sizeof(Number), sizeof(MemCell), sizeof(MemoryTree)};
+	stats->heap = vm->heap.size;
+	stats->image = vm->image_size;
+	for (int i=0; i<4; i++) {
+		stats->live[i] = pools[i]->live;
+		stats->peak[i] = pools[i]->peak;
+		stats->sizes[i] = sizes[i];
+	}
+	stats->rotwidth = vm->rotwidth;
+	stats->max_wordwidth = vm->max_wordwidth;
+}
+
+const char* mu_error(const MuVm* vm) {
+	return vm->error;
+}
+
+#ifndef UNSHACKLED_LIBRARY
+
+/*
+ * Command line interface: checkpoints, writing images, the image cache
+ * and main.
+ */
+
+/*
+ * Checkpoints.
+ *
+ * A checkpoint consists of a base image <prefix>.base holding the complete
+ * state and an append-only log <prefix>.log of delta records. Each delta
+ * record holds the registers and only those cells that changed since the
+ * previous checkpoint. Restoring loads the base and replays the log.
+ * Compaction writes the current state as a new base and truncates the log.
+ *
+ * Cells are written as pairs of numbers (address, value). Numbers are
+ * written as head, unicode, width and the trits packed four per byte,
+ * starting at the least significant trit. Values are in host byte order.
+ */
+
+#define CHECKPOINT_BASE_MAGIC 0x4243554du // "MUCB"
+#define CHECKPOINT_LOG_MAGIC 0x4c44554du // "MUDL"
+// 2: the registers include the state of the random number generator and
+// the growth count. A newline cached as unicode -3 did not need a new
+// version: like -1 it is an invalid instruction, and out recognizes both
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_RETRY (1 << 20) // steps until a deferred checkpoint is tried again
+
+// errors are left in the error indicator of f and reported by sync_and_close
+static void write_bytes(FILE* f, const void* buf, size_t size) {
+	if (size) {
+		fwrite(buf,size,1,f);
+	}
+}
+
+static void read_or_die(FILE* f, void* buf, size_t size) {
+	if (size && fread(buf,size,1,f) != 1) {
+		fprintf(stderr,"error: corrupt checkpoint\n");
+		exit(1);
+	}
+}
+
+static inline void write_u64(FILE* f, uint64_t v) {
+	write_bytes(f,&v,sizeof(v));
+}
+
+static inline uint64_t read_u64(FILE* f) {
+	uint64_t v;
+	read_or_die(f,&v,sizeof(v));
+	return v;
+}
+
+static inline void write_number_header(FILE* f, int_fast8_t head, int32_t unicode, uintmax_t width) {
+	uint8_t h = (uint8_t)head;
+	write_bytes(f,&h,1);
+	write_bytes(f,&unicode,sizeof(unicode));
+	write_u64(f,(uint64_t)width);
+}
+
+static void write_number(FILE* f, Number* n) {
+	write_number_header(f,n->head,n->unicode,n->width);
+	Trits* it = n->tail;
+	uint8_t packed = 0;
+	for (uintmax_t i=0; i<n->width; i++) {
+		packed |= (uint8_t)(it->trit << (2*(i%4)));
+		if (i%4 == 3 || i == n->width-1) {
+			write_bytes(f,&packed,1);
+			packed = 0;
+		}
+		it = it->left;
+	}
+}
+
+// trits[0] is the least significant trit
+static void write_address(FILE* f, int_fast8_t head, const int_fast8_t* trits, uintmax_t width) {
+	write_number_header(f,head,-2,width);
+	uint8_t packed = 0;
+	for (uintmax_t i=0; i<width; i++) {
+		packed |= (uint8_t)(trits[i] << (2*(i%4)));
+		if (i%4 == 3 || i == width-1) {
+			write_bytes(f,&packed,1);
+			packed = 0;
+		}
+	}
+}
+
+static Number* read_number(Heap* heap, FILE* f) {
+	uint8_t head;
+	int32_t unicode;
+	read_or_die(f,&head,1);
+	read_or_die(f,&unicode,sizeof(unicode));
+	uintmax_t width = (uintmax_t)read_u64(f);
+	if (head > T2 || (width == 0 && unicode < 0)) {
+		fprintf(stderr,"error: corrupt checkpoint\n");
+		exit(1);
+	}
+	Number* n = alloc_number(heap);
+	n->head = head;
+	n->width = width;
+	n->memptr = 0; // to be computed
+	n->unicode = unicode;
+	n->tail = 0;
+	if (width == 0) {
+		return n; // xlat2 applied, see repair_number_after_xlat2
+	}
+	Trits* it = 0;
+	uint8_t packed = 0;
+	for (uintmax_t i=0; i<width; i++) {
+		if (i%4 == 0) {
+			read_or_die(f,&packed,1);
+		}
+		Trits* t = alloc_trits(heap);
+		t->trit = (packed >> (2*(i%4))) & 3;
+		if (t->trit > T2) {
+			fprintf(stderr,"error: corrupt checkpoint\n");
+			exit(1);
+		}
+		if (it) {
+			it->left = t;
+			t->right = it;
+		}else{
+			n->tail = t;
+		}
+		it = t;
+	}
+	it->left = n->tail;
+	n->tail->right = it;
+	return n;
+}
+
+static void write_registers(FILE* f, Vm* vm) {
+	write_u64(f,vm->step);
+	write_u64(f,(uint64_t)vm->pos);
+	write_u64(f,vm->rotwidth);
+	write_u64(f,vm->max_wordwidth);
+	write_u64(f,vm->random);
+	write_u64(f,vm->growth_events);
+	write_number(f,vm->a);
+	write_number(f,vm->c);
+	write_number(f,vm->d);
+}
+
+static void read_registers(FILE* f, Vm* vm) {
+	Heap* heap = &vm->heap;
+	vm->step = read_u64(f);
+	vm->pos = (int)read_u64(f);
+	vm->rotwidth = read_u64(f);
+	vm->max_wordwidth = read_u64(f);
+	vm->random = read_u64(f);
+	vm->growth_events = read_u64(f);
+	free_number(heap,&vm->a);
+	free_number(heap,&vm->c);
+	free_number(heap,&vm->d);
+	vm->a = read_number(heap,f);
+	vm->c = read_number(heap,f);
+	vm->d = read_number(heap,f);
+	if (vm->pos < 0 || vm->pos >= 564 || !vm->c->width || !vm->d->width) {
+		fprintf(stderr,"error: corrupt checkpoint\n");
+		exit(1);
+	}
+}
+
+static inline void write_cell(FILE* f, int_fast8_t head, const int_fast8_t* trits, uintmax_t width, Number* val) {
+	uint8_t more = 1;
+	write_bytes(f,&more,1);
+	write_address(f,head,trits,width);
+	write_number(f,val);
+}
+
+// returns nonzero if out of memory
+static int write_tree(FILE* f, MemoryTree* node, int_fast8_t head, int_fast8_t** trits, uintmax_t* size, uintmax_t depth) {
+	for (int_fast8_t t=0; t<3; t++) {
+		MemoryTree* child = node->child[t];
+		if (!child) continue;
+		if (depth == *size) {
+			int_fast8_t* grown = (int_fast8_t*)realloc(*trits,2*(*size)*sizeof(int_fast8_t));
+			if (!grown) {
+				return 1;
+			}
+			*trits = grown;
+			*size = 2*(*size);
+		}
+		(*trits)[depth] = t;
+		// a child reached by the head trit shares the cell of its parent
+		if (t != head && child->cell->val) {
+			write_cell(f,head,*trits,depth+1,child->cell->val);
+		}
+		if (write_tree(f,child,head,trits,size,depth+1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// writes all initialized cells followed by an end marker; returns nonzero if out of memory
+static int write_all_cells(FILE* f, Vm* vm) {
+	uintmax_t size = 64;
+	int_fast8_t* trits = (int_fast8_t*)malloc(size*sizeof(int_fast8_t));
+	if (!trits) {
+		return 1;
+	}
+	for (int_fast8_t h=0; h<3; h++) {
+		trits[0] = h;
+		if (vm->memory[h].cell->val) {
+			write_cell(f,h,trits,1,vm->memory[h].cell->val);
+		}
+		if (write_tree(f,&vm->memory[h],h,&trits,&size,0)) {
+			free(trits);
+			return 1;
+		}
+	}
+	free(trits);
+	uint8_t more = 0;
+	write_bytes(f,&more,1);
+	return 0;
+}
+
+// writes the cells changed since the last checkpoint followed by an end marker
+static void write_dirty_cells(FILE* f, Vm* vm) {
+	for (size_t i=0; i<vm->dirty_count; i++) {
+		if (vm->dirty[i].cell->val) {
+			uint8_t more = 1;
+			write_bytes(f,&more,1);
+			write_number(f,vm->dirty[i].addr);
+			write_number(f,vm->dirty[i].cell->val);
+		}
+	}
+	uint8_t more = 0;
+	write_bytes(f,&more,1);
+}
+
+static void clear_dirty(Vm* vm) {
+	Heap* heap = &vm->heap;
+	for (size_t i=0; i<vm->dirty_count; i++) {
+		vm->dirty[i].cell->dirty = 0;
+		free_number(heap,&vm->dirty[i].addr);
+	}
+	vm->dirty_count = 0;
+}
+
+static void read_cells(FILE* f, Vm* vm) {
+	Heap* heap = &vm->heap;
+	uint8_t more;
+	read_or_die(f,&more,1);
+	while (more) {
+		Number* addr = read_number(heap,f);
+		if (!addr->width) {
+			fprintf(stderr,"error: corrupt checkpoint\n");
+			exit(1);
+		}
+		update_memptr(heap,addr,vm->memory);
+		MemCell* cell = addr->memptr;
+		if (cell->val) {
+			free_number(heap,&cell->val);
+		}
+		cell->val = read_number(heap,f);
+		free_number(heap,&addr);
+		read_or_die(f,&more,1);
+	}
+}
+
+// returns 0 if out of memory
+static char* checkpoint_path(const char* prefix, const char* suffix) {
+	char* path = (char*)malloc(strlen(prefix)+strlen(suffix)+1);
+	if (path) {
+		strcpy(path,prefix);
+		strcat(path,suffix);
+	}
+	return path;
+}
+
+// returns nonzero if any write to f failed
+static int sync_and_close(FILE* f) {
+	int failed = (ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0);
+	return (fclose(f) != 0 || failed);
+}
+
+static inline uint64_t new_base_id(Vm* vm) {
+	return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ vm->step;
+}
+
+/*
+ * The writers below report errors by their return value rather than by
+ * exiting: they also run in a forked child, which must end with _exit
+ * and leave the stdio buffers it inherited alone.
+ */
+
+// writes the complete state as new base with the given id and truncates the log;
+// returns nonzero on error
+static int write_base(Vm* vm, const char* prefix, uint64_t id) {
+	char* path = checkpoint_path(prefix,".base");
+	char* tmp_path = checkpoint_path(prefix,".base.tmp");
+	char* log_path = checkpoint_path(prefix,".log");
+	int ret = 1;
+	FILE* f = 0;
+	if (!path || !tmp_path || !log_path) {
+		fprintf(stderr,"out of memory");
+		goto done;
+	}
+	f = fopen(tmp_path,"wb");
+	if (!f) {
+		fprintf(stderr,"error: cannot write checkpoint %s\n",tmp_path);
+		goto done;
+	}
+	uint32_t magic = CHECKPOINT_BASE_MAGIC;
+	uint32_t version = CHECKPOINT_VERSION;
+	write_bytes(f,&magic,sizeof(magic));
+	write_bytes(f,&version,sizeof(version));
+	write_u64(f,id);
+	write_u64(f,vm->growth_slack);
+	write_u64(f,vm->growth_step);
+	write_u64(f,vm->growth_prob);
+	write_u64(f,(uint64_t)vm->det_growth);
+	for (int i=0; i<6; i++) {
+		write_number(f,vm->initial_values[i]);
+	}
+	write_registers(f,vm);
+	int oom = write_all_cells(f,vm);
+	if (sync_and_close(f) || oom) {
+		if (oom) {
+			fprintf(stderr,"out of memory");
+		}else{
+			fprintf(stderr,"error: cannot write checkpoint %s\n",tmp_path);
+		}
+		unlink(tmp_path);
+		goto done;
+	}
+	if (rename(tmp_path,path) != 0) {
+		fprintf(stderr,"error: cannot write checkpoint %s\n",path);
+		unlink(tmp_path);
+		goto done;
+	}
+	// records left in the log belong to the old base and are skipped by id anyway
+	f = fopen(log_path,"wb");
+	if (f) {
+		fclose(f);
+	}
+	ret = 0;
+done:
+	free(path);
+	free(tmp_path);
+	free(log_path);
+	return ret;
+}
+
+// appends a record with the cells changed since the last checkpoint; returns nonzero on error
+static int append_delta(Vm* vm, const char* prefix, uint64_t base_id) {
+	char* buf = 0;
+	size_t len = 0;
+	FILE* rec = open_memstream(&buf,&len);
+	char* log_path = checkpoint_path(prefix,".log");
+	if (!rec || !log_path) {
+		fprintf(stderr,"out of memory");
+		if (rec) {
+			fclose(rec);
+		}
+		free(buf);
+		free(log_path);
+		return 1;
+	}
+	write_registers(rec,vm);
+	write_dirty_cells(rec,vm);
+	int ret = (fclose(rec) != 0);
+	FILE* f = (ret ? 0 : fopen(log_path,"ab"));
+	if (f) {
+		uint32_t magic = CHECKPOINT_LOG_MAGIC;
+		write_bytes(f,&magic,sizeof(magic));
+		write_u64(f,base_id);
+		write_u64(f,(uint64_t)len);
+		write_bytes(f,buf,len);
+		ret = sync_and_close(f);
+	}
+	if (!f || ret) {
+		fprintf(stderr,"error: cannot write checkpoint %s\n",log_path);
+		ret = 1;
+	}
+	free(buf);
+	free(log_path);
+	return ret;
+}
+
+// the log is merged into a new base once it is larger than the base
+static int log_outgrew_base(const char* prefix) {
+	char* path = checkpoint_path(prefix,".base");
+	char* log_path = checkpoint_path(prefix,".log");
+	struct stat base_st, log_st;
+	int ret = (!path || !log_path || stat(path,&base_st) != 0 || (stat(log_path,&log_st) == 0 && log_st.st_size > base_st.st_size));
+	free(path);
+	free(log_path);
+	return ret;
+}
+
+typedef struct Checkpointer {
+	const char* prefix;
+	int fork; // serialize in a forked child while the interpreter continues
+	int wait; // wait for a running child before exit
+	int have_base; // a base matching the current log exists
+	uint64_t base_id;
+	pid_t child; // child still writing a checkpoint; 0: none
+} Checkpointer;
+
+static Checkpointer* exit_checkpointer = 0;
+
+static void wait_for_checkpoint(void) {
+	if (exit_checkpointer && exit_checkpointer->child > 0) {
+		waitpid(exit_checkpointer->child,0,0);
+		exit_checkpointer->child = 0;
+	}
+}
+
+// returns 1 if the checkpoint was taken, 0 if it is deferred because the last one is still being written
+static int checkpoint(Vm* vm, Checkpointer* ck) {
+	// output up to the checkpoint must not be lost if the run is resumed from it
+	if (flush_output(vm)) {
+		vm_fail(vm,"error: output error");
+		return 1;
+	}
+	if (ck->child) {
+		int status;
+		pid_t ret = waitpid(ck->child,&status,WNOHANG);
+		if (ret == 0) {
+			return 0; // keep the dirty cells for the retry
+		}
+		ck->child = 0;
+		if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			ck->have_base = 0; // state of the log is unknown; start over
+		}
+	}
+	if (ck->have_base && log_outgrew_base(ck->prefix)) {
+		ck->have_base = 0;
+	}
+	int full = !ck->have_base;
+	uint64_t id = (full ? new_base_id(vm) : ck->base_id);
+	pid_t pid = (ck->fork ? fork() : -1);
+	if (pid == 0) {
+		// the child owns a copy-on-write snapshot of the vm; it must not
+		// flush stdio buffers inherited from the parent
+		__fpurge(stdout);
+		exit_checkpointer = 0;
+		_exit(full ? write_base(vm,ck->prefix,id) : append_delta(vm,ck->prefix,id));
+	}
+	if (pid > 0) {
+		ck->child = pid;
+	}else if (full ? write_base(vm,ck->prefix,id) : append_delta(vm,ck->prefix,id)) {
+		exit(1);
+	}
+	clear_dirty(vm);
+	ck->have_base = 1;
+	ck->base_id = id;
+	return 1;
+}
+
+// loads base and log into a freshly initialized vm; returns the id of the base
+static uint64_t restore_checkpoint(Vm* vm, const char* prefix) {
+	Heap* heap = &vm->heap;
+	char* path = checkpoint_path(prefix,".base");
+	char* log_path = checkpoint_path(prefix,".log");
+	if (!path || !log_path) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	FILE* f = fopen(path,"rb");
+	if (!f) {
+		fprintf(stderr,"checkpoint not found: %s\n",path);
+		exit(1);
+	}
+	uint32_t magic, version;
+	read_or_die(f,&magic,sizeof(magic));
+	read_or_die(f,&version,sizeof(version));
+	if (magic != CHECKPOINT_BASE_MAGIC || version != CHECKPOINT_VERSION) {
+		fprintf(stderr,"error: not a checkpoint: %s\n",path);
+		exit(1);
+	}
+	uint64_t id = read_u64(f);
+	vm->growth_slack = read_u64(f);
+	vm->growth_step = read_u64(f);
+	vm->growth_prob = read_u64(f);
+	vm->det_growth = (int)read_u64(f);
+	for (int i=0; i<6; i++) {
+		vm->initial_values[i] = read_number(heap,f);
+		update_memptr(heap,vm->initial_values[i],vm->memory);
+	}
+	read_registers(f,vm);
+	read_cells(f,vm);
+	fclose(f);
+
+	f = fopen(log_path,"rb");
+	if (f) {
+		while (1) {
+			uint64_t base_id, len;
+			if (fread(&magic,sizeof(magic),1,f) != 1 || magic != CHECKPOINT_LOG_MAGIC
+					|| fread(&base_id,sizeof(base_id),1,f) != 1
+					|| fread(&len,sizeof(len),1,f) != 1) {
+				break;
+			}
+			char* buf = (char*)malloc_or_die(len ? len : 1);
+			if (fread(buf,1,len,f) != len) {
+				free(buf); // record truncated by a crash while appending
+				break;
+			}
+			if (base_id == id) {
+				FILE* rec = fmemopen(buf,len,"rb");
+				if (!rec) {
+					fprintf(stderr,"out of memory");
+					exit(1);
+				}
+				read_registers(rec,vm);
+				read_cells(rec,vm);
+				fclose(rec);
+			}
+			free(buf);
+		}
+		fclose(f);
+	}
+	update_memptr(heap,vm->c,vm->memory);
+	update_memptr(heap,vm->d,vm->memory);
+	free(path);
+	free(log_path);
+	return id;
+}
+
+// FNV-1a
+static uint64_t hash_source(const char* src, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i=0; i<size; i++) {
+		hash ^= (unsigned char)src[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+typedef struct ImageBuilder {
+	char* buf;
+	uintptr_t base;
+	MemoryTree* nodes;
+	MemCell* cells;
+	Number* numbers;
+	Trits* trits;
+} ImageBuilder;
+
+// address of a pointer into the builder's buffer once the image is mapped
+static inline void* image_ptr(ImageBuilder* b, void* p) {
+	return p ? (void*)((char*)p - b->buf + b->base) : 0;
+}
+
+static void count_image_number(ImageHeader* h, Number* n) {
+	if (n) {
+		h->number_count++;
+		h->trits_count += n->width;
+	}
+}
+
+static void count_image_tree(ImageHeader* h, MemoryTree* node, int_fast8_t head) {
+	for (int_fast8_t t=0; t<3; t++) {
+		if (!node->child[t]) continue;
+		h->node_count++;
+		if (t != head) {
+			h->cell_count++;
+			count_image_number(h,node->child[t]->cell->val);
+		}
+		count_image_tree(h,node->child[t],head);
+	}
+}
+
+static Number* build_image_number(ImageBuilder* b, Number* in) {
+	if (!in) return 0;
+	Number* n = b->numbers++;
+	n->head = in->head;
+	n->width = in->width;
+	n->memptr = 0; // to be computed
+	n->unicode = in->unicode;
+	n->tail = 0;
+	if (!in->width) {
+		return (Number*)image_ptr(b,n);
+	}
+	Trits* first = b->trits;
+	b->trits += in->width;
+	Trits* in_it = in->tail;
+	for (uintmax_t i=0; i<in->width; i++) {
+		first[i].trit = in_it->trit;
+		first[i].left = (Trits*)image_ptr(b,&first[(i+1)%in->width]);
+		first[i].right = (Trits*)image_ptr(b,&first[(i+in->width-1)%in->width]);
+		in_it = in_it->left;
+	}
+	n->tail = (Trits*)image_ptr(b,first);
+	return (Number*)image_ptr(b,n);
+}
+
+static MemCell* build_image_cell(ImageBuilder* b, MemCell* in) {
+	MemCell* cell = b->cells++;
+	cell->val = build_image_number(b,in->val);
+	cell->next = 0;
+	cell->dirty = 0;
+	cell->saved = 0;
+	return (MemCell*)image_ptr(b,cell);
+}
+
+// copies the children of in into node; cell is the image address of the cell of node
+static void build_image_tree(ImageBuilder* b, MemoryTree* node, MemoryTree* in, MemCell* cell, int_fast8_t head) {
+	for (int_fast8_t t=0; t<3; t++) {
+		if (!in->child[t]) {
+			node->child[t] = 0;
+			continue;
+		}
+		MemoryTree* child = b->nodes++;
+		node->child[t] = (MemoryTree*)image_ptr(b,child);
+		// a child reached by the head trit shares the cell of its parent
+		child->cell = (t == head ? cell : build_image_cell(b,in->child[t]->cell));
+		build_image_tree(b,child,in->child[t],child->cell,head);
+	}
+}
+
+// writes the image to f and closes it; returns 0 on success
+static int write_image(Vm* vm, FILE* f, const char* source, size_t source_size) {
+	ImageHeader h;
+	memset(&h,0,sizeof(h));
+	h.magic = IMAGE_MAGIC;
+	h.version = IMAGE_VERSION;
+	h.sizes[0] = sizeof(MemoryTree);
+	h.sizes[1] = sizeof(MemCell);
+	h.sizes[2] = sizeof(Number);
+	h.sizes[3] = sizeof(Trits);
+	h.base = IMAGE_BASE;
+	h.pos = (uint64_t)vm->pos;
+	h.program_size = vm->program_size;
+	h.source_size = source_size;
+	h.source_hash = hash_source(source,source_size);
+	for (int_fast8_t i=0; i<3; i++) {
+		h.node_count++;
+		h.cell_count++;
+		count_image_number(&h,vm->memory[i].cell->val);
+		count_image_tree(&h,&vm->memory[i],i);
+	}
+	for (int i=0; i<6; i++) {
+		count_image_number(&h,vm->initial_values[i]);
+	}
+	size_t size = sizeof(h) + h.node_count*sizeof(MemoryTree) + h.cell_count*sizeof(MemCell)
+			+ h.number_count*sizeof(Number) + h.trits_count*sizeof(Trits) + source_size;
+	h.size = size;
+
+	ImageBuilder b;
+	b.buf = (char*)calloc(1,size);
+	if (!b.buf) {
+		fclose(f);
+		return 1;
+	}
+	b.base = IMAGE_BASE;
+	b.nodes = (MemoryTree*)(b.buf + sizeof(h));
+	b.cells = (MemCell*)(b.nodes + h.node_count);
+	b.numbers = (Number*)(b.cells + h.cell_count);
+	b.trits = (Trits*)(b.numbers + h.number_count);
+	MemoryTree* roots = b.nodes;
+	b.nodes += 3;
+	for (int_fast8_t i=0; i<3; i++) {
+		roots[i].cell = build_image_cell(&b,vm->memory[i].cell);
+		build_image_tree(&b,&roots[i],&vm->memory[i],roots[i].cell,i);
+	}
+	for (int i=0; i<6; i++) {
+		h.initial_values[i] = (uint64_t)(uintptr_t)build_image_number(&b,vm->initial_values[i]);
+	}
+	memcpy(b.buf,&h,sizeof(h));
+	memcpy(b.trits,source,source_size);
+
+	int ret = (fwrite(b.buf,1,size,f) != size);
+	if (fclose(f) != 0) {
+		ret = 1;
+	}
+	free(b.buf);
+	return ret;
+}
+
+static inline const char* image_source(ImageHeader* h) {
+	return (const char*)h + h->size - h->source_size;
+}
+
+typedef struct Source {
+	const char* data;
+	size_t size;
+	int mapped;
+} Source;
+
+// returns 0 on success
+static int read_source(int fd, Source* src) {
+	struct stat st;
+	src->data = 0;
+	src->size = 0;
+	src->mapped = 0;
+	if (fstat(fd,&st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) {
+			return 0;
+		}
+		void* mem = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (mem != MAP_FAILED) {
+			madvise(mem,st.st_size,MADV_SEQUENTIAL);
+			src->data = (const char*)mem;
+			src->size = st.st_size;
+			src->mapped = 1;
+			// consume the file as read would; on stdin the program reads what follows
+			lseek(fd,0,SEEK_END);
+			return 0;
+		}
+	}
+	size_t cap = 1 << 20;
+	char* buf = (char*)malloc_or_die(cap);
+	while (1) {
+		if (src->size == cap) {
+			cap *= 2;
+			buf = (char*)realloc(buf,cap);
+			if (!buf) {
+				fprintf(stderr,"out of memory");
+				exit(1);
+			}
+		}
+		ssize_t ret = read(fd,buf+src->size,cap-src->size);
+		if (ret == 0) {
+			break;
+		}
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			free(buf);
+			fprintf(stderr, "error: input error\n");
+			return 1;
+		}
+		src->size += ret;
+	}
+	src->data = buf;
+	return 0;
+}
+
+static void free_source(Source* src) {
+	if (src->mapped) {
+		munmap((void*)src->data,src->size);
+	}else{
+		free((void*)src->data);
+	}
+}
+
+/*
+ * Image cache.
+ *
+ * Processes that run the same program can share its initialized memory.
+ * The cache is a directory, preferably on tmpfs such as /dev/shm, that
+ * holds one image per program, named by the hash and size of the source.
+ * An image is written once by the first process to load that program,
+ * and is published by an atomic rename. Later processes map it. The
+ * mapping is private, so all processes share the pages of the image until
+ * they write to them, and every process gets its own copy of the cells it
+ * changes. The source stored in the image is compared with the program,
+ * so a hash collision cannot run the wrong program. Nothing is ever
+ * evicted from the cache.
+ *
+ * Images are mapped and their pointers followed, so the cache is only
+ * used if nobody else can write to it: the directory is created with mode
+ * 0700, and an existing one must belong to the user and must not be
+ * writable by group or others. Images are validated on mapping as well.
+ */
+
+static char* image_cache_path(const char* dir, const Source* src) {
+	char name[64];
+	snprintf(name,sizeof(name),"/%016" PRIx64 "-%zu.img",hash_source(src->data,src->size),src->size);
+	char* path = (char*)malloc_or_die(strlen(dir)+strlen(name)+1);
+	strcpy(path,dir);
+	strcat(path,name);
+	return path;
+}
+
+static void publish_image(Vm* vm, const char* dir, const Source* src, const char* path) {
+	char* tmp_path = (char*)malloc_or_die(strlen(dir)+16);
+	strcpy(tmp_path,dir);
+	strcat(tmp_path,"/.tmp-XXXXXX");
+	int fd = mkstemp(tmp_path);
+	FILE* f = (fd >= 0 ? fdopen(fd,"wb") : 0);
+	if (!f) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		return; // the cache is optional
+	}
+	fchmod(fd,0644);
+	if (write_image(vm,f,src->data,src->size) || rename(tmp_path,path) != 0) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
+
+// creates dir if needed; returns 1 if only the user can write to it
+static int cache_dir_private(const char* dir) {
+	struct stat st;
+	mkdir(dir,0700);
+	if (lstat(dir,&st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022)) {
+		fprintf(stderr,"warning: not using image cache %s, it must be a directory only the user can write to\n",dir);
+		return 0;
+	}
+	return 1;
+}
+
+// loads the program from fd, through the image cache in dir; returns 0 on success
+static int load_cached(Vm* vm, const char* dir, int fd, int threads) {
+	Source src;
+	if (read_source(fd,&src)) {
+		return 1;
+	}
+	if (!cache_dir_private(dir)) {
+		int err = load_source(vm,src.data,src.size,threads);
+		free_source(&src);
+		return err;
+	}
+	char* path = image_cache_path(dir,&src);
+	ImageHeader* h = map_image(vm,path,1);
+	if (h && h->source_size == src.size && memcmp(image_source(h),src.data,src.size) == 0) {
+		install_image(vm,h);
+		free_source(&src);
+		free(path);
+		return 0;
+	}
+	if (h) {
+		munmap(h,h->size);
+	}
+	int err = load_source(vm,src.data,src.size,threads);
+	if (!err) {
+		publish_image(vm,dir,&src,path);
+	}
+	free_source(&src);
+	free(path);
+	return err;
+}
+
+/*
+ * Interleaved runs.
+ *
+ * Runs many jobs as green threads on a single thread: every job is a vm
+ * that runs for a quantum of steps before the next one gets its turn, and
+ * a job waiting for input is skipped until its input is readable. Input
+ * is read without blocking and decoded from a buffer; output is collected
+ * per job and written in job order, so the result is the same as running
+ * the jobs one after another with the same seed.
+ */
+
+#define JOB_READ_SIZE (64 << 10)
+
+typedef struct Job {
+	MuVm* vm;
+	const char* input_name;
+	int fd; // -1: no input
+	unsigned char* in; // input not decoded yet
+	size_t in_start;
+	size_t in_end;
+	int eof;
+	char* out;
+	size_t out_size;
+	size_t out_cap;
+	int status; // MU_RUNNING until the job has finished
+	int waiting; // for its input to become readable
+} Job;
+
+static int32_t job_read(void* ctx) {
+	Job* job = (Job*)ctx;
+	if (job->in_start == job->in_end) {
+		return (job->eof ? MU_EOF : MU_WOULD_BLOCK);
+	}
+	int32_t symbol;
+	int len = decode_utf8(job->in+job->in_start,job->in_end-job->in_start,&symbol);
+	if (len == 0 && !job->eof) {
+		return MU_WOULD_BLOCK;
+	}
+	if (len <= 0) {
+		vm_fail(job->vm,"invalid utf-8 encoding while reading from %s",job->input_name);
+		return MU_INPUT_ERROR;
+	}
+	job->in_start += len;
+	return symbol;
+}
+
+static int job_write(void* ctx, int32_t symbol) {
+	Job* job = (Job*)ctx;
+	if (job->out_cap - job->out_size < 4) {
+		job->out_cap = (job->out_cap ? 2*job->out_cap : 256);
+		job->out = (char*)realloc(job->out,job->out_cap);
+		if (!job->out) {
+			fprintf(stderr,"out of memory");
+			exit(1);
+		}
+	}
+	job->out_size += encode_utf8(symbol,job->out+job->out_size);
+	return 0;
+}
+
+// reads more input without blocking; sets waiting if none is available yet
+static void fill_job_input(Job* job) {
+	if (job->in_start > 0) {
+		memmove(job->in,job->in+job->in_start,job->in_end-job->in_start);
+		job->in_end -= job->in_start;
+		job->in_start = 0;
+	}
+	ssize_t len = read(job->fd,job->in+job->in_end,JOB_READ_SIZE);
+	if (len > 0) {
+		job->in_end += len;
+	}else if (len == 0) {
+		job->eof = 1;
+	}else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		job->waiting = 1;
+	}else if (errno != EINTR) {
+		vm_fail(job->vm,"error: input error");
+	}
+}
+
+// runs programs[i] with inputs[i]; a single program runs with every input,
+// and programs without inputs read no input; returns the exit status
+static int run_interleaved(char** programs, int program_count, char** inputs, int input_count, uintmax_t quantum, uint64_t seed) {
+	int count = (input_count > program_count ? input_count : program_count);
+	if (input_count && program_count != 1 && input_count != program_count) {
+		fprintf(stderr,"error: %d programs but %d inputs\n",program_count,input_count);
+		return 1;
+	}
+	Job* jobs = (Job*)calloc(count,sizeof(Job));
+	struct pollfd* fds = (struct pollfd*)malloc_or_die(count*sizeof(struct pollfd));
+	if (!jobs) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	Source src;
+	int loaded = -1; // index of the program in src
+	for (int i=0; i<count; i++) {
+		Job* job = &jobs[i];
+		int p = (program_count == 1 ? 0 : i);
+		if (loaded != p) {
+			if (loaded >= 0) {
+				free_source(&src);
+			}
+			int fd = open(programs[p],O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "file not found: %s\n",programs[p]);
+				return 1;
+			}
+			if (read_source(fd,&src)) {
+				return 1;
+			}
+			close(fd);
+			loaded = p;
+		}
+		job->vm = mu_create(seed);
+		MuIo io = {job_read, job_write, job};
+		mu_set_io(job->vm,&io);
+		job->status = MU_RUNNING;
+		job->fd = -1;
+		job->eof = 1;
+		if (input_count) {
+			job->input_name = inputs[i];
+			// opening a pipe blocks until it has a writer; only reading must not block
+			job->fd = open(inputs[i],O_RDONLY);
+			if (job->fd < 0) {
+				fprintf(stderr, "file not found: %s\n",inputs[i]);
+				return 1;
+			}
+			fcntl(job->fd,F_SETFL,fcntl(job->fd,F_GETFL) | O_NONBLOCK);
+			job->in = (unsigned char*)malloc_or_die(2*JOB_READ_SIZE);
+			job->eof = 0;
+		}
+		if (mu_load(job->vm,src.data,src.size,1)) {
+			job->status = MU_ERROR;
+		}
+	}
+	if (loaded >= 0) {
+		free_source(&src);
+	}
+
+	int running = 0;
+	for (int i=0; i<count; i++) {
+		running += (jobs[i].status == MU_RUNNING);
+	}
+	int flushed = 0; // jobs whose results have been written
+	int ret = 0;
+	while (1) {
+		// results are written in job order
+		while (flushed < count && jobs[flushed].status != MU_RUNNING) {
+			Job* job = &jobs[flushed];
+			fwrite(job->out,1,job->out_size,stdout);
+			if (job->status == MU_ERROR) {
+				fflush(stdout);
+				fprintf(stderr,"%s\n",mu_error(job->vm));
+				ret = 1;
+			}
+			free(job->out);
+			free(job->in);
+			if (job->fd >= 0) {
+				close(job->fd);
+			}
+			mu_destroy(job->vm);
+			flushed++;
+		}
+		if (!running) {
+			break;
+		}
+		for (int i=flushed; i<count; i++) {
+			Job* job = &jobs[i];
+			if (job->status != MU_RUNNING || job->waiting) {
+				continue;
+			}
+			int status = mu_run(job->vm,quantum);
+			while (status == MU_NEED_INPUT && job->vm->status == MU_RUNNING) {
+				fill_job_input(job);
+				if (job->waiting) {
+					break;
+				}
+				status = mu_run(job->vm,quantum);
+			}
+			if (job->vm->status != MU_RUNNING) {
+				job->status = job->vm->status;
+				job->waiting = 0;
+				running--;
+			}
+		}
+		// check the waiting jobs; block only if no other job can run
+		int n = 0;
+		for (int i=flushed; i<count; i++) {
+			if (jobs[i].waiting) {
+				fds[n].fd = jobs[i].fd;
+				fds[n].events = POLLIN;
+				fds[n].revents = 0;
+				n++;
+			}
+		}
+		if (n) {
+			while (poll(fds,n,(n == running ? -1 : 0)) < 0 && errno == EINTR);
+			n = 0;
+			for (int i=flushed; i<count; i++) {
+				if (jobs[i].waiting) {
+					jobs[i].waiting = !fds[n].revents;
+					n++;
+				}
+			}
+		}
+	}
+	free(fds);
+	free(jobs);
+	return ret;
+}
+
+/*
+ * Input sweeps.
+ *
+ * Runs one program with many inputs. Runs execute the same steps until
+ * they read different input, so a sweep starts with a single vm for all
+ * runs. Whenever the runs of a vm read different symbols, the process
+ * forks once per further symbol; every group of runs reading the same
+ * symbol continues on its own copy-on-write copy of the vm. Output is
+ * appended to a temporary file per run, which whichever process owns the
+ * run writes to, and results go to shared memory, so that the first
+ * process can write everything in input order, like --interleave.
+ *
+ * At most --sweep-jobs processes run at once; they share a count of the
+ * processes that may still be forked. A process that finds none left,
+ * or cannot fork, drops the runs it would have handed to a child, and
+ * the first process starts those over in another pass once all others
+ * are done. Each pass finishes at least the first run that is left.
+ */
+
+#define LANE_BUFFER 4096
+
+typedef struct Lane {
+	const char* input_name;
+	Source input;
+	size_t pos;
+	int invalid; // its last symbol was not valid UTF-8
+	FILE* out; // temporary file, written through its descriptor only
+	size_t out_len;
+	char buf[LANE_BUFFER];
+} Lane;
+
+typedef struct LaneResult {
+	int status;
+	int pending; // to be run in the next pass
+	char error[256];
+} LaneResult;
+
+typedef struct Sweep {
+	MuVm* vm;
+	Lane* lanes;
+	LaneResult* results; // shared by all processes
+	int* active; // lanes run by this process
+	int32_t* next; // next symbol of every active lane
+	int* next_len;
+	int active_count;
+	pid_t* children;
+	int child_count;
+	int* slots; // processes that may still be forked, shared by all processes
+} Sweep;
+
+// reaps the children that are done, which frees their slots
+static void reap_children(Sweep* s) {
+	int n = 0;
+	for (int i=0; i<s->child_count; i++) {
+		if (waitpid(s->children[i],0,WNOHANG) == s->children[i]) {
+			__atomic_add_fetch(s->slots,1,__ATOMIC_RELAXED);
+		}else{
+			s->children[n++] = s->children[i];
+		}
+	}
+	s->child_count = n;
+}
+
+// returns 1 if a slot for another process was taken
+static int take_slot(Sweep* s) {
+	reap_children(s);
+	int n = __atomic_load_n(s->slots,__ATOMIC_RELAXED);
+	while (n > 0) {
+		if (__atomic_compare_exchange_n(s->slots,&n,n-1,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void flush_lane(Lane* lane) {
+	size_t done = 0;
+	while (done < lane->out_len) {
+		ssize_t ret = write(fileno(lane->out),lane->buf+done,lane->out_len-done);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"error: cannot write temporary file\n");
+			_exit(1);
+		}
+		done += ret;
+	}
+	lane->out_len = 0;
+}
+
+// returns the next symbol of lane, MU_EOF or MU_INPUT_ERROR, and its length in bytes
+static int32_t lane_symbol(Lane* lane, int* len) {
+	*len = 0;
+	if (lane->pos == lane->input.size) {
+		return MU_EOF;
+	}
+	int32_t symbol;
+	*len = decode_utf8((const unsigned char*)lane->input.data+lane->pos,lane->input.size-lane->pos,&symbol);
+	return (*len > 0 ? symbol : MU_INPUT_ERROR);
+}
+
+static int32_t sweep_read(void* ctx) {
+	Sweep* s = (Sweep*)ctx;
+	for (int i=0; i<s->active_count; i++) {
+		s->next[i] = lane_symbol(&s->lanes[s->active[i]],&s->next_len[i]);
+	}
+	// hand the lanes reading another symbol than the first lane to children
+	for (int other=1; other<s->active_count; other++) {
+		int32_t symbol = s->next[other];
+		if (symbol == s->next[0]) {
+			continue;
+		}
+		pid_t pid = -1;
+		if (take_slot(s)) {
+			fflush(stdout);
+			pid = fork();
+			if (pid < 0) {
+				__atomic_add_fetch(s->slots,1,__ATOMIC_RELAXED);
+			}
+		}
+		if (pid < 0) {
+			// the lanes reading symbol start over in the next pass
+			int n = 0;
+			for (int i=0; i<s->active_count; i++) {
+				if (s->next[i] == symbol) {
+					s->results[s->active[i]].pending = 1;
+				}else{
+					s->active[n] = s->active[i];
+					s->next[n] = s->next[i];
+					s->next_len[n] = s->next_len[i];
+					n++;
+				}
+			}
+			s->active_count = n;
+			other = 0;
+			continue;
+		}
+		// the child keeps the lanes reading symbol, the parent the others
+		int n = 0;
+		for (int i=0; i<s->active_count; i++) {
+			if ((s->next[i] == symbol) == (pid == 0)) {
+				s->active[n] = s->active[i];
+				s->next[n] = s->next[i];
+				s->next_len[n] = s->next_len[i];
+				n++;
+			}
+		}
+		s->active_count = n;
+		if (pid == 0) {
+			s->child_count = 0;
+			break;
+		}
+		s->children[s->child_count++] = pid;
+		other = 0;
+	}
+	for (int i=0; i<s->active_count; i++) {
+		Lane* lane = &s->lanes[s->active[i]];
+		lane->pos += s->next_len[i];
+		lane->invalid = (s->next[i] == MU_INPUT_ERROR);
+	}
+	if (s->next[0] == MU_INPUT_ERROR) {
+		vm_fail(s->vm,"invalid utf-8 encoding while reading from %s",s->lanes[s->active[0]].input_name);
+	}
+	return s->next[0];
+}
+
+static int sweep_write(void* ctx, int32_t symbol) {
+	Sweep* s = (Sweep*)ctx;
+	char p[4];
+	int len = encode_utf8(symbol,p);
+	for (int i=0; i<s->active_count; i++) {
+		Lane* lane = &s->lanes[s->active[i]];
+		if (LANE_BUFFER - lane->out_len < (size_t)len) {
+			flush_lane(lane);
+		}
+		memcpy(lane->buf+lane->out_len,p,len);
+		lane->out_len += len;
+	}
+	return 0;
+}
+
+// runs program with every input in at most jobs processes at once; returns the exit status
+static int run_sweep(const char* program, char** inputs, int input_count, int jobs, uint64_t seed) {
+	int count = (input_count ? input_count : 1);
+	Sweep s;
+	s.lanes = (Lane*)calloc(count,sizeof(Lane));
+	s.active = (int*)malloc_or_die(count*sizeof(int));
+	s.next = (int32_t*)malloc_or_die(count*sizeof(int32_t));
+	s.next_len = (int*)malloc_or_die(count*sizeof(int));
+	s.children = (pid_t*)malloc_or_die(count*sizeof(pid_t));
+	s.child_count = 0;
+	s.results = (LaneResult*)mmap(0,count*sizeof(LaneResult),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	s.slots = (int*)mmap(0,sizeof(int),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if (!s.lanes || s.results == MAP_FAILED || s.slots == MAP_FAILED) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	for (int i=0; i<count; i++) {
+		Lane* lane = &s.lanes[i];
+		s.results[i].status = MU_ERROR;
+		s.results[i].pending = 1;
+		strcpy(s.results[i].error,"error: run did not finish");
+		if (input_count) {
+			lane->input_name = inputs[i];
+			int fd = open(inputs[i],O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "file not found: %s\n",inputs[i]);
+				return 1;
+			}
+			if (read_source(fd,&lane->input)) {
+				return 1;
+			}
+			close(fd);
+		}
+		lane->out = tmpfile();
+		if (!lane->out) {
+			fprintf(stderr,"error: cannot create temporary file\n");
+			return 1;
+		}
+		// the processes sharing the file must not overwrite each other
+		fcntl(fileno(lane->out),F_SETFL,fcntl(fileno(lane->out),F_GETFL) | O_APPEND);
+	}
+	int fd = open(program,O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "file not found: %s\n",program);
+		return 1;
+	}
+	Source src;
+	if (read_source(fd,&src)) {
+		return 1;
+	}
+	close(fd);
+	pid_t root = getpid();
+	*s.slots = jobs-1;
+	while (1) {
+		s.active_count = 0;
+		for (int i=0; i<count; i++) {
+			if (s.results[i].pending) {
+				Lane* lane = &s.lanes[i];
+				s.results[i].pending = 0;
+				s.active[s.active_count++] = i;
+				// drop the output of a run dropped in the last pass
+				lane->pos = 0;
+				lane->invalid = 0;
+				lane->out_len = 0;
+				if (ftruncate(fileno(lane->out),0) != 0) {
+					fprintf(stderr,"error: cannot write temporary file\n");
+					return 1;
+				}
+			}
+		}
+		if (!s.active_count) {
+			break;
+		}
+		s.vm = mu_create(seed);
+		MuIo io = {sweep_read, sweep_write, &s};
+		mu_set_io(s.vm,&io);
+		if (!mu_load(s.vm,src.data,src.size,1)) {
+			mu_run(s.vm,UINTMAX_MAX);
+		}
+		for (int i=0; i<s.active_count; i++) {
+			Lane* lane = &s.lanes[s.active[i]];
+			LaneResult* result = &s.results[s.active[i]];
+			flush_lane(lane);
+			result->status = s.vm->status;
+			if (lane->invalid) {
+				snprintf(result->error,sizeof(result->error),"invalid utf-8 encoding while reading from %s",lane->input_name);
+			}else{
+				snprintf(result->error,sizeof(result->error),"%s",mu_error(s.vm));
+			}
+		}
+		// a process outlives its children, so the first one outlives all
+		for (int i=0; i<s.child_count; i++) {
+			while (waitpid(s.children[i],0,0) < 0 && errno == EINTR);
+			__atomic_add_fetch(s.slots,1,__ATOMIC_RELAXED);
+		}
+		s.child_count = 0;
+		if (getpid() != root) {
+			_exit(0);
+		}
+		mu_destroy(s.vm);
+	}
+
+	int ret = 0;
+	for (int i=0; i<count; i++) {
+		Lane* lane = &s.lanes[i];
+		char buf[1 << 16];
+		size_t len;
+		rewind(lane->out);
+		while ((len = fread(buf,1,sizeof(buf),lane->out)) > 0) {
+			fwrite(buf,1,len,stdout);
+		}
+		fclose(lane->out);
+		if (s.results[i].status == MU_ERROR) {
+			fflush(stdout);
+			fprintf(stderr,"%s\n",s.results[i].error);
+			ret = 1;
+		}
+		free_source(&lane->input);
+	}
+	free_source(&src);
+	munmap(s.results,count*sizeof(LaneResult));
+	munmap(s.slots,sizeof(int));
+	free(s.children);
+	free(s.next_len);
+	free(s.next);
+	free(s.active);
+	free(s.lanes);
+	return ret;
+}
+
+/*
+ * Batch runs.
+ *
+ * Runs the jobs of a manifest on several threads. Each line of the
+ * manifest names a program, an input file ("-" for none), an output file
+ * and optionally a budget of steps; empty lines and lines starting with #
+ * are skipped. Every program is read once. The jobs are dealt out to
+ * per-thread deques; a thread takes its own jobs from the back and, once
+ * it has none left, steals from the front of another thread's deque.
+ * Every vm allocates from its own heap, so the threads share no allocator
+ * state besides malloc itself. A thread keeps its vm and resets it if the
+ * next job runs the same program. A report line per job with its result,
+ * steps, wall time and peak memory is written to stdout in manifest order.
+ * The peak memory is in bytes of objects: the loaded program and the most
+ * the job's own run added to it, also when the vm was reused.
+ */
+
+typedef struct BatchJob {
+	char* program;
+	char* input;
+	char* output;
+	uintmax_t budget; // 0: unlimited
+	Source* source;
+	const char* result;
+	uintmax_t steps;
+	double seconds;
+	size_t memory;
+	char* error;
+} BatchJob;
+
+typedef struct Deque {
+	pthread_mutex_t lock;
+	int* jobs;
+	int front;
+	int back;
+} Deque;
+
+typedef struct Batch {
+	BatchJob* jobs;
+	Deque* deques;
+	int threads;
+	uint64_t seed;
+} Batch;
+
+typedef struct Worker {
+	Batch* batch;
+	int id;
+	MuVm* vm; // vm of the previous job
+	const Source* program; // program loaded into vm and snapshotted; 0: none
+	size_t loaded; // bytes in objects right after loading program
+} Worker;
+
+// bytes in the objects of vm, at their peak or in use
+static size_t object_bytes(const MuVm* vm, int peak) {
+	MuMemoryStats s;
+	mu_memory_stats(vm,&s);
+	size_t bytes = 0;
+	for (int i=0; i<4; i++) {
+		bytes += (peak ? s.peak[i] : s.live[i])*s.sizes[i];
+	}
+	return bytes;
+}
+
+// I/O of a batch job: the whole input in memory, the output to a file
+typedef struct BatchIo {
+	MuVm* vm;
+	const char* name;
+	const unsigned char* data;
+	size_t size;
+	size_t pos;
+	FILE* out;
+} BatchIo;
+
+static int32_t batch_read(void* ctx) {
+	BatchIo* io = (BatchIo*)ctx;
+	if (io->pos == io->size) {
+		return MU_EOF;
+	}
+	int32_t symbol;
+	int len = decode_utf8(io->data+io->pos,io->size-io->pos,&symbol);
+	if (len <= 0) {
+		vm_fail(io->vm,"invalid utf-8 encoding while reading from %s",io->name);
+		return MU_INPUT_ERROR;
+	}
+	io->pos += len;
+	return symbol;
+}
+
+static int batch_write(void* ctx, int32_t symbol) {
+	BatchIo* io = (BatchIo*)ctx;
+	char buf[4];
+	int len = encode_utf8(symbol,buf);
+	return fwrite(buf,1,len,io->out) != (size_t)len;
+}
+
+// returns a job from the back of the deque, or from the front if steal is set; -1 if empty
+static int take_job(Deque* q, int steal) {
+	int job = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->front < q->back) {
+		job = (steal ? q->jobs[q->front++] : q->jobs[--q->back]);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+// runs job on the vm of the worker, which is reset instead of reloaded if
+// the previous job ran the same program
+static void run_batch_job(Worker* w, BatchJob* job) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	MuVm* vm = w->vm;
+	size_t reset = 0; // bytes in objects after mu_reset; these include trie nodes of earlier jobs
+	if (vm && w->program == job->source) {
+		mu_reset(vm);
+		reset = object_bytes(vm,0);
+	}else{
+		if (vm) {
+			mu_destroy(vm);
+		}
+		vm = w->vm = mu_create(w->batch->seed);
+		w->program = 0;
+	}
+	Source input = {0, 0, 0};
+	BatchIo io = {vm, job->input, 0, 0, 0, 0};
+	if (strcmp(job->input,"-") != 0) {
+		int fd = open(job->input,O_RDONLY);
+		if (fd < 0) {
+			vm_fail(vm,"file not found: %s",job->input);
+		}else{
+			if (read_source(fd,&input)) {
+				vm_fail(vm,"error: input error");
+			}
+			close(fd);
+		}
+		io.data = (const unsigned char*)input.data;
+		io.size = input.size;
+	}
+	if (vm->status == MU_RUNNING) {
+		io.out = fopen(job->output,"wb");
+		if (!io.out) {
+			vm_fail(vm,"error: cannot write %s",job->output);
+		}
+	}
+	if (vm->status == MU_RUNNING && !w->program) {
+		if (!mu_load(vm,job->source->data,job->source->size,1) && !mu_snapshot(vm)) {
+			w->program = job->source;
+			w->loaded = object_bytes(vm,0);
+		}
+	}
+	if (vm->status == MU_RUNNING && w->program) {
+		MuIo callbacks = {batch_read, batch_write, &io};
+		mu_set_io(vm,&callbacks);
+		mu_run(vm,(job->budget ? job->budget : UINTMAX_MAX));
+	}
+	if (io.out && fclose(io.out) != 0) {
+		vm_fail(vm,"error: cannot write %s",job->output);
+	}
+	job->result = (vm->status == MU_HALTED ? "halted" : vm->status == MU_ERROR ? "error" : "budget");
+	job->steps = (vm->step ? vm->step-1 : 0);
+	// mu_memory would include the largest earlier job of a reused vm; count
+	// what this run added to the loaded program instead
+	job->memory = object_bytes(vm,1);
+	if (reset) {
+		job->memory = job->memory - reset + w->loaded;
+	}
+	if (vm->status == MU_ERROR) {
+		job->error = strdup(mu_error(vm));
+	}
+	if (input.data) {
+		free_source(&input);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1e-9;
+}
+
+static void* batch_worker(void* arg) {
+	Worker* w = (Worker*)arg;
+	Batch* batch = w->batch;
+	while (1) {
+		int job = take_job(&batch->deques[w->id],0);
+		// no job is ever added, so the batch is done once all deques are empty
+		for (int i=1; job < 0 && i<batch->threads; i++) {
+			job = take_job(&batch->deques[(w->id+i)%batch->threads],1);
+		}
+		if (job < 0) {
+			if (w->vm) {
+				mu_destroy(w->vm);
+			}
+			return 0;
+		}
+		run_batch_job(w,&batch->jobs[job]);
+	}
+}
+
+static int compare_programs(const void* a, const void* b) {
+	return strcmp((*(BatchJob* const*)a)->program,(*(BatchJob* const*)b)->program);
+}
+
+// returns the exit status
+static int run_batch(const char* manifest, int threads, uint64_t seed) {
+	FILE* f = fopen(manifest,"r");
+	if (!f) {
+		fprintf(stderr, "file not found: %s\n",manifest);
+		return 1;
+	}
+	BatchJob* jobs = 0;
+	int count = 0;
+	char* line = 0;
+	size_t line_size = 0;
+	int line_number = 0;
+	while (getline(&line,&line_size,f) >= 0) {
+		line_number++;
+		char program[4096], input[4096], output[4096];
+		char budget[64] = "0";
+		int fields = sscanf(line,"%4095s %4095s %4095s %63s",program,input,output,budget);
+		if (fields <= 0 || program[0] == '#') {
+			continue;
+		}
+		if (fields < 3) {
+			fprintf(stderr,"error: %s:%d: expected program, input, output and budget\n",manifest,line_number);
+			return 1;
+		}
+		jobs = (BatchJob*)realloc(jobs,(count+1)*sizeof(BatchJob));
+		if (!jobs) {
+			fprintf(stderr,"out of memory");
+			exit(1);
+		}
+		memset(&jobs[count],0,sizeof(BatchJob));
+		jobs[count].program = strdup(program);
+		jobs[count].input = strdup(input);
+		jobs[count].output = strdup(output);
+		jobs[count].budget = strtoumax(budget,0,10);
+		count++;
+	}
+	free(line);
+	fclose(f);
+
+	// read every program once
+	BatchJob** sorted = (BatchJob**)malloc_or_die((count ? count : 1)*sizeof(BatchJob*));
+	Source* sources = (Source*)malloc_or_die((count ? count : 1)*sizeof(Source));
+	int source_count = 0;
+	for (int i=0; i<count; i++) {
+		sorted[i] = &jobs[i];
+	}
+	qsort(sorted,count,sizeof(BatchJob*),compare_programs);
+	for (int i=0; i<count; i++) {
+		if (i == 0 || strcmp(sorted[i]->program,sorted[i-1]->program) != 0) {
+			int fd = open(sorted[i]->program,O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "file not found: %s\n",sorted[i]->program);
+				return 1;
+			}
+			if (read_source(fd,&sources[source_count])) {
+				return 1;
+			}
+			close(fd);
+			source_count++;
+		}
+		sorted[i]->source = &sources[source_count-1];
+	}
+	free(sorted);
+
+	if (threads > count) {
+		threads = (count ? count : 1);
+	}
+	Batch batch = {jobs, 0, threads, seed};
+	batch.deques = (Deque*)malloc_or_die(threads*sizeof(Deque));
+	for (int t=0; t<threads; t++) {
+		Deque* q = &batch.deques[t];
+		pthread_mutex_init(&q->lock,0);
+		q->jobs = (int*)malloc_or_die((count/threads+1)*sizeof(int));
+		q->front = 0;
+		q->back = 0;
+		// first jobs at the back, where the owner takes them from
+		for (int i=count-1-(count-1-t)%threads; i>=t && count; i-=threads) {
+			q->jobs[q->back++] = i;
+		}
+	}
+	Worker* workers = (Worker*)malloc_or_die(threads*sizeof(Worker));
+	pthread_t* ids = (pthread_t*)malloc_or_die(threads*sizeof(pthread_t));
+	for (int t=0; t<threads; t++) {
+		workers[t].batch = &batch;
+		workers[t].id = t;
+		workers[t].vm = 0;
+		workers[t].program = 0;
+		if (t > 0 && pthread_create(&ids[t],0,batch_worker,&workers[t]) != 0) {
+			fprintf(stderr,"error: cannot create thread\n");
+			exit(1);
+		}
+	}
+	batch_worker(&workers[0]);
+	for (int t=1; t<threads; t++) {
+		pthread_join(ids[t],0);
+	}
+
+	int ret = 0;
+	printf("# job\tresult\tsteps\tseconds\tmemory\tprogram\tinput\toutput\terror\n");
+	for (int i=0; i<count; i++) {
+		BatchJob* job = &jobs[i];
+		printf("%d\t%s\t%ju\t%.6f\t%zu\t%s\t%s\t%s\t%s\n",i+1,job->result,job->steps,job->seconds,
+				job->memory,job->program,job->input,job->output,(job->error ? job->error : ""));
+		if (job->error) {
+			ret = 1;
+		}
+		free(job->program);
+		free(job->input);
+		free(job->output);
+		free(job->error);
+	}
+	for (int i=0; i<source_count; i++) {
+		free_source(&sources[i]);
+	}
+	for (int t=0; t<threads; t++) {
+		pthread_mutex_destroy(&batch.deques[t].lock);
+		free(batch.deques[t].jobs);
+	}
+	free(batch.deques);
+	free(sources);
+	free(workers);
+	free(ids);
+	free(jobs);
+	return ret;
+}
+
+/*
+ * I/O threads.
+ *
+ * With --io-threads a reader thread decodes stdin and a writer thread
+ * encodes stdout. Each is connected to the interpreter by a ring of code
+ * points with a single producer and a single consumer. A side that finds
+ * the ring empty or full spins for a while and then sleeps on a condition
+ * variable of its own; the other side only takes the lock if it sees the
+ * sleeping flag of that side, so the interpreter does not enter the kernel
+ * while both sides keep up. The interpreter moves its end of a ring privately and publishes it
+ * every RING_BATCH symbols, before it waits, and as the flush policy
+ * demands, so the cache lines of head and tail do not bounce between the
+ * cores on every symbol. MU_EOF and MU_INPUT_ERROR end the input ring;
+ * MU_EOF ends the output.
+ */
+
+#define RING_SIZE (1 << 16)
+#define RING_SPINS 4096
+#define RING_BATCH 256
+
+typedef struct Ring {
+	size_t head __attribute__((aligned(64))); // written by the producer only
+	size_t tail __attribute__((aligned(64))); // written by the consumer only
+	int sleeping[2] __attribute__((aligned(64))); // by side: 1 the producer, 0 the consumer waits
+	pthread_mutex_t lock;
+	pthread_cond_t cond[2];
+	int spins; // 0 on a single processor, where the other side cannot run meanwhile
+	size_t next __attribute__((aligned(64))); // private end of the interpreter
+	size_t seen; // head of the input or tail of the output last loaded by the interpreter
+	int32_t data[RING_SIZE];
+} Ring;
+
+typedef struct IoThreads {
+	Vm* vm;
+	Ring in;
+	Ring out;
+	Decoder decoder;
+	int flush; // MU_FLUSH_*
+	int write_error;
+	pthread_t reader;
+	pthread_t writer;
+} IoThreads;
+
+// 1 if the producer can write to the ring, or the consumer can read from it
+static inline int ring_ready(Ring* r, int producer) {
+	size_t head = __atomic_load_n(&r->head,__ATOMIC_SEQ_CST);
+	size_t tail = __atomic_load_n(&r->tail,__ATOMIC_SEQ_CST);
+	return (producer ? head - tail < RING_SIZE : head != tail);
+}
+
+static void ring_wait(Ring* r, int producer) {
+	for (int i=0; i<r->spins; i++) {
+		if (ring_ready(r,producer)) {
+			return;
+		}
+#ifdef __SSE2__
+		_mm_pause();
+#endif
+	}
+	pthread_mutex_lock(&r->lock);
+	__atomic_store_n(&r->sleeping[producer],1,__ATOMIC_SEQ_CST);
+	while (!ring_ready(r,producer)) {
+		pthread_cond_wait(&r->cond[producer],&r->lock);
+	}
+	__atomic_store_n(&r->sleeping[producer],0,__ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// wakes the other side after producer moved head or the consumer moved tail
+static inline void ring_notify(Ring* r, int producer) {
+	if (__atomic_load_n(&r->sleeping[!producer],__ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond[!producer]);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+static void ring_write(Ring* r, const int32_t* symbols, size_t count) {
+	while (count) {
+		size_t head = r->head;
+		size_t space = RING_SIZE - (head - __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE));
+		if (!space) {
+			ring_wait(r,1);
+			continue;
+		}
+		size_t n = (count < space ? count : space);
+		for (size_t i=0; i<n; i++) {
+			r->data[(head+i) & (RING_SIZE-1)] = symbols[i];
+		}
+		__atomic_store_n(&r->head,head+n,__ATOMIC_SEQ_CST);
+		ring_notify(r,1);
+		symbols += n;
+		count -= n;
+	}
+}
+
+static void* reader_thread(void* arg) {
+	IoThreads* t = (IoThreads*)arg;
+	Decoder* d = &t->decoder;
+	int32_t ret;
+	while (!(ret = decode_input(d))) {
+		ring_write(&t->in,d->decoded,d->decoded_count);
+	}
+	ring_write(&t->in,&ret,1);
+	return 0;
+}
+
+static void* writer_thread(void* arg) {
+	IoThreads* t = (IoThreads*)arg;
+	Ring* r = &t->out;
+	char* buf = (char*)malloc_or_die(4*RING_SIZE);
+	int done = 0;
+	while (!done) {
+		ring_wait(r,0);
+		size_t tail = r->tail;
+		size_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+		size_t len = 0;
+		for (; tail != head; tail++) {
+			int32_t symbol = r->data[tail & (RING_SIZE-1)];
+			if (symbol < 0) {
+				done = 1;
+				break;
+			}
+			if (t->vm->raw) {
+				buf[len++] = (char)symbol;
+			}else{
+				len += encode_utf8(symbol,buf+len);
+			}
+		}
+		size_t written = 0;
+		while (written < len && !t->write_error) {
+			ssize_t ret = write(STDOUT_FILENO,buf+written,len-written);
+			if (ret >= 0) {
+				written += ret;
+			}else if (errno != EINTR) {
+				__atomic_store_n(&t->write_error,1,__ATOMIC_RELAXED);
+			}
+		}
+		__atomic_store_n(&r->tail,tail,__ATOMIC_SEQ_CST);
+		ring_notify(r,0);
+	}
+	free(buf);
+	return 0;
+}
+
+// makes the private end of the interpreter visible to the thread
+static inline void ring_publish(Ring* r, int producer) {
+	size_t* end = (producer ? &r->head : &r->tail);
+	if (*end != r->next) {
+		__atomic_store_n(end,r->next,__ATOMIC_SEQ_CST);
+		ring_notify(r,producer);
+	}
+}
+
+static int32_t threaded_read(void* ctx) {
+	IoThreads* t = (IoThreads*)ctx;
+	Ring* r = &t->in;
+	if (t->flush == MU_FLUSH_INPUT) {
+		ring_publish(&t->out,1);
+	}
+	if (r->next == r->seen && r->next == (r->seen = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE))) {
+		ring_publish(&t->out,1);
+		ring_publish(r,0);
+		ring_wait(r,0);
+		r->seen = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+	}
+	int32_t symbol = r->data[r->next & (RING_SIZE-1)];
+	if (symbol < 0) {
+		// the end of the input stays in the ring
+		return (symbol == MU_INPUT_ERROR ? invalid_utf8(t->vm) : symbol);
+	}
+	if (++r->next - r->tail >= RING_BATCH) {
+		ring_publish(r,0);
+	}
+	return symbol;
+}
+
+static int threaded_write(void* ctx, int32_t symbol) {
+	IoThreads* t = (IoThreads*)ctx;
+	Ring* r = &t->out;
+	if (__atomic_load_n(&t->write_error,__ATOMIC_RELAXED)) {
+		return 1;
+	}
+	if (r->next - r->seen == RING_SIZE
+			&& r->next - (r->seen = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE)) == RING_SIZE) {
+		ring_publish(r,1);
+		ring_wait(r,1);
+		r->seen = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+	}
+	r->data[r->next++ & (RING_SIZE-1)] = symbol;
+	if (r->next - r->head >= RING_BATCH || (symbol == '\n' && t->flush != MU_FLUSH_SIZE)) {
+		ring_publish(r,1);
+	}
+	return 0;
+}
+
+static IoThreads* start_io_threads(Vm* vm) {
+	IoThreads* t = (IoThreads*)calloc(1,sizeof(IoThreads));
+	if (!t) {
+		fprintf(stderr,"out of memory");
+		exit(1);
+	}
+	t->vm = vm;
+	t->decoder.fd = STDIN_FILENO;
+	t->decoder.raw = vm->raw;
+	t->flush = (vm->flush >= 0 ? vm->flush : isatty(STDOUT_FILENO) ? MU_FLUSH_INPUT : MU_FLUSH_SIZE);
+	t->in.spins = t->out.spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0);
+	Ring* rings[2] = {&t->in, &t->out};
+	for (int i=0; i<2; i++) {
+		pthread_mutex_init(&rings[i]->lock,0);
+		pthread_cond_init(&rings[i]->cond[0],0);
+		pthread_cond_init(&rings[i]->cond[1],0);
+	}
+	if (pthread_create(&t->reader,0,reader_thread,t) != 0
+			|| pthread_create(&t->writer,0,writer_thread,t) != 0) {
+		fprintf(stderr,"error: cannot create thread\n");
+		exit(1);
+	}
+	// the reader may block on stdin after the program has halted
+	pthread_detach(t->reader);
+	MuIo io = {threaded_read, threaded_write, t};
+	mu_set_io(vm,&io);
+	return t;
+}
+
+// waits until all output is written; returns 0 on success
+static int stop_io_threads(IoThreads* t) {
+	int32_t end = MU_EOF;
+	ring_publish(&t->out,1);
+	ring_write(&t->out,&end,1);
+	pthread_join(t->writer,0);
+	return t->write_error;
+}
+
+/*
+ * Memory statistics, written to stderr at exit and on SIGUSR1 with
+ * --memory-stats. They are formatted without stdio, so that the signal
+ * handler can write them.
+ */
+
+static Vm* stats_vm; // vm reported on SIGUSR1
+
+static char* append_text(char* p, const char* text) {
+	while (*text) {
+		*p++ = *text++;
+	}
+	return p;
+}
+
+static char* append_uint(char* p, uintmax_t value) {
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = (char)('0' + value%10);
+	} while (value /= 10);
+	while (n) {
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+static void write_memory_stats(Vm* vm) {
+	static const char* names[4] = {"trits", "numbers", "cells", "nodes"};
+	MuMemoryStats s;
+	mu_memory_stats(vm,&s);
+	char buf[512];
+	char* p = append_text(buf,"memory: heap ");
+	p = append_uint(p,s.heap);
+	p = append_text(p," bytes, image ");
+	p = append_uint(p,s.image);
+	p = append_text(p," bytes, rotwidth ");
+	p = append_uint(p,s.rotwidth);
+	p = append_text(p,", max_wordwidth ");
+	p = append_uint(p,s.max_wordwidth);
+	p = append_text(p,"\n");
+	for (int i=0; i<4; i++) {
+		p = append_text(p,"  ");
+		p = append_text(p,names[i]);
+		p = append_text(p,": ");
+		p = append_uint(p,s.live[i]);
+		p = append_text(p," live (");
+		p = append_uint(p,s.live[i]*s.sizes[i]);
+		p = append_text(p," bytes), peak ");
+		p = append_uint(p,s.peak[i]);
+		p = append_text(p," (");
+		p = append_uint(p,s.peak[i]*s.sizes[i]);
+		p = append_text(p," bytes)\n");
+	}
+	size_t done = 0;
+	while (done < (size_t)(p-buf)) {
+		ssize_t ret = write(STDERR_FILENO,buf+done,(p-buf)-done);
+		if (ret < 0 && errno != EINTR) {
+			break;
+		}
+		done += (ret > 0 ? ret : 0);
+	}
+}
+
+static void report_memory_stats(int sig) {
+	(void)sig;
+	int saved_errno = errno;
+	write_memory_stats(stats_vm);
+	errno = saved_errno;
+}
+
+/*
+ * Metrics page. With --metrics FILE (preferably on /dev/shm) the
+ * interpreter maps FILE shared and publishes its counters there every
+ * METRICS_INTERVAL steps and at exit, with relaxed atomic stores, so a
+ * scraper can read them at any time without stopping it. A page may
+ * briefly mix counters of two updates. --read-metrics prints pages in the
+ * OpenMetrics text format.
+ */
+
+#define METRICS_MAGIC 0x4d55534349525445ull
+#define METRICS_VERSION 1
+#define METRICS_INTERVAL (1 << 20)
+
+typedef struct MetricsPage {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t pid;
+	uint64_t running; // 0 once the interpreter has finished
+	uint64_t steps;
+	uint64_t steps_per_second; // during the last interval
+	uint64_t executed[EXECUTED_COUNT+1]; // by EXECUTED_*, then nops
+	uint64_t heap;
+	uint64_t image;
+	uint64_t live[4]; // trits, numbers, cells and trie nodes
+	uint64_t rotwidth;
+	uint64_t max_wordwidth;
+	uint64_t growth_events;
+} MetricsPage;
+
+typedef struct Metrics {
+	MetricsPage* page;
+	uintmax_t steps; // at the last update
+	double time;
+} Metrics;
+
+static double monotonic_seconds(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static inline void publish(uint64_t* field, uint64_t value) {
+	__atomic_store_n(field,value,__ATOMIC_RELAXED);
+}
+
+static void update_metrics(Metrics* m, Vm* vm, int running) {
+	MetricsPage* p = m->page;
+	double now = monotonic_seconds();
+	uintmax_t steps = vm->step - 1;
+	if (now > m->time) {
+		publish(&p->steps_per_second,(uint64_t)((steps - m->steps)/(now - m->time)));
+	}
+	m->steps = steps;
+	m->time = now;
+	publish(&p->steps,steps);
+	uintmax_t counted = 0;
+	for (int i=0; i<EXECUTED_COUNT; i++) {
+		publish(&p->executed[i],vm->executed[i]);
+		counted += (i == EXECUTED_HLT ? 0 : vm->executed[i]); // hlt does not complete a step
+	}
+	publish(&p->executed[EXECUTED_COUNT],(steps > counted ? steps - counted : 0));
+	MuMemoryStats s;
+	mu_memory_stats(vm,&s);
+	publish(&p->heap,s.heap);
+	publish(&p->image,s.image);
+	for (int i=0; i<4; i++) {
+		publish(&p->live[i],s.live[i]);
+	}
+	publish(&p->rotwidth,s.rotwidth);
+	publish(&p->max_wordwidth,s.max_wordwidth);
+	publish(&p->growth_events,vm->growth_events);
+	publish(&p->running,running);
+}
+
+// returns 0 on success
+static int open_metrics(Metrics* m, const char* path, Vm* vm) {
+	int fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0644);
+	if (fd < 0 || ftruncate(fd,sizeof(MetricsPage)) != 0) {
+		fprintf(stderr,"error: cannot create metrics page %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	m->page = (MetricsPage*)mmap(0,sizeof(MetricsPage),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (m->page == MAP_FAILED) {
+		fprintf(stderr,"error: cannot map metrics page %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	m->steps = vm->step - 1;
+	m->time = monotonic_seconds();
+	m->page->pid = (uint64_t)getpid();
+	m->page->version = METRICS_VERSION;
+	update_metrics(m,vm,1);
+	// readers ignore the page until the magic is there
+	__atomic_store_n(&m->page->magic,METRICS_MAGIC,__ATOMIC_RELEASE);
+	return 0;
+}
+
+typedef struct MetricFamily {
+	const char* name;
+	const char* type;
+	const char* help;
+	size_t offset; // of the value in MetricsPage
+	const char* label; // name of the label of an array of values; 0: a single value
+	const char* const* values; // label values
+	int count;
+} MetricFamily;
+
+// prints the metrics pages at paths in the OpenMetrics text format
+static int read_metrics(char** paths, int count) {
+	static const char* const instructions[EXECUTED_COUNT+1] = {"jmp", "out", "in", "rot", "movd", "opr", "hlt", "nop"};
+	static const char* const kinds[4] = {"trits", "numbers", "cells", "nodes"};
+	static const MetricFamily families[] = {
+		{"unshackled_running", "gauge", "1 while the interpreter runs", offsetof(MetricsPage,running), 0, 0, 1},
+		{"unshackled_steps", "counter", "Steps executed", offsetof(MetricsPage,steps), 0, 0, 1},
+		{"unshackled_steps_per_second", "gauge", "Steps per second during the last interval",
+				offsetof(MetricsPage,steps_per_second), 0, 0, 1},
+		{"unshackled_instructions", "counter", "Instructions executed",
+				offsetof(MetricsPage,executed), "instruction", instructions, EXECUTED_COUNT+1},
+		{"unshackled_heap_bytes", "gauge", "Bytes allocated by the interpreter", offsetof(MetricsPage,heap), 0, 0, 1},
+		{"unshackled_image_bytes", "gauge", "Bytes of the mapped program image", offsetof(MetricsPage,image), 0, 0, 1},
+		{"unshackled_live_objects", "gauge", "Objects in use", offsetof(MetricsPage,live), "kind", kinds, 4},
+		{"unshackled_rotwidth", "gauge", "Rotation width", offsetof(MetricsPage,rotwidth), 0, 0, 1},
+		{"unshackled_max_wordwidth", "gauge", "Widest word moved to D", offsetof(MetricsPage,max_wordwidth), 0, 0, 1},
+		{"unshackled_growth_events", "counter", "Times the rotation width has grown",
+				offsetof(MetricsPage,growth_events), 0, 0, 1},
+	};
+	MetricsPage* pages = (MetricsPage*)calloc(count,sizeof(MetricsPage));
+	if (!pages) {
+		fprintf(stderr,"out of memory");
+		return 1;
+	}
+	int status = 0;
+	for (int i=0; i<count; i++) {
+		int fd = open(paths[i],O_RDONLY);
+		MetricsPage* p = (fd < 0 ? MAP_FAILED : (MetricsPage*)mmap(0,sizeof(MetricsPage),PROT_READ,MAP_SHARED,fd,0));
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (p == MAP_FAILED || __atomic_load_n(&p->magic,__ATOMIC_ACQUIRE) != METRICS_MAGIC || p->version != METRICS_VERSION) {
+			fprintf(stderr,"error: no metrics page: %s\n",paths[i]);
+			if (p != MAP_FAILED) {
+				munmap(p,sizeof(MetricsPage));
+			}
+			status = 1;
+			continue;
+		}
+		uint64_t* from = (uint64_t*)p;
+		uint64_t* to = (uint64_t*)&pages[i];
+		for (size_t k=0; k<sizeof(MetricsPage)/sizeof(uint64_t); k++) {
+			to[k] = __atomic_load_n(&from[k],__ATOMIC_RELAXED);
+		}
+		munmap(p,sizeof(MetricsPage));
+	}
+	for (size_t f=0; f<sizeof(families)/sizeof(families[0]); f++) {
+		const MetricFamily* fam = &families[f];
+		int counter = (strcmp(fam->type,"counter") == 0);
+		printf("# TYPE %s %s\n# HELP %s %s.\n",fam->name,fam->type,fam->name,fam->help);
+		for (int i=0; i<count; i++) {
+			if (pages[i].magic != METRICS_MAGIC) {
+				continue;
+			}
+			const uint64_t* values = (const uint64_t*)((const char*)&pages[i] + fam->offset);
+			for (int k=0; k<fam->count; k++) {
+				printf("%s%s{pid=\"%" PRIu64 "\"",fam->name,(counter ? "_total" : ""),pages[i].pid);
+				if (fam->label) {
+					printf(",%s=\"%s\"",fam->label,fam->values[k]);
+				}
+				printf("} %" PRIu64 "\n",values[k]);
+			}
+		}
+	}
+	printf("# EOF\n");
+	free(pages);
+	return status;
+}
+
+#ifdef PROFILE
+static void write_histogram(FILE* f, const uintmax_t* histogram) {
+	fprintf(f,"[");
+	for (int i=0; i<=PROFILE_WIDTHS; i++) {
+		fprintf(f,"%s%ju",(i ? ", " : ""),histogram[i]);
+	}
+	fprintf(f,"]");
+}
+
+// writes the hardware counters of each phase, and of the average step
+static void write_counters(FILE* f, Vm* vm) {
+	Profile* p = &vm->profile;
+	static const char* names[PROFILE_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+	static const char* phases[PROFILE_PHASES] = {"load", "fill", "run"};
+	int available = 0;
+	for (int i=0; i<PROFILE_COUNTERS; i++) {
+		available |= (p->counter_index[i] >= 0);
+	}
+	if (!available) {
+		fprintf(f,"  \"counters\": null,\n  \"counters_error\": \"%s\",\n",strerror(p->counter_error));
+		return;
+	}
+	fprintf(f,"  \"counters\": {");
+	for (int phase=0; phase<PROFILE_PHASES; phase++) {
+		fprintf(f,"%s\n    \"%s\": {",(phase ? "," : ""),phases[phase]);
+		for (int i=0; i<PROFILE_COUNTERS; i++) {
+			fprintf(f,"%s\"%s\": ",(i ? ", " : ""),names[i]);
+			if (p->counter_index[i] >= 0) {
+				fprintf(f,"%" PRIu64,p->counters[phase][i]);
+			}else{
+				fprintf(f,"null");
+			}
+		}
+		fprintf(f,"}");
+	}
+	uint64_t* run = p->counters[PROFILE_RUN];
+	double steps = (vm->step > 1 ? (double)(vm->step-1) : 1);
+	fprintf(f,"\n  },\n  \"per_step\": {\"ipc\": ");
+	if (p->counter_index[0] >= 0 && p->counter_index[1] >= 0 && run[0]) {
+		fprintf(f,"%.3f",(double)run[1]/run[0]);
+	}else{
+		fprintf(f,"null");
+	}
+	for (int i=0; i<PROFILE_COUNTERS; i++) {
+		fprintf(f,", \"%s\": ",names[i]);
+		if (p->counter_index[i] >= 0) {
+			fprintf(f,"%.3f",run[i]/steps);
+		}else{
+			fprintf(f,"null");
+		}
+	}
+	fprintf(f,"},\n");
+}
+
+// writes the profile of the vm as JSON to path
+static void write_profile(Vm* vm, const char* path) {
+	Profile* p = &vm->profile;
+	FILE* f = fopen(path,"w");
+	if (!f) {
+		fprintf(stderr,"error: cannot write profile %s\n",path);
+		return;
+	}
+	static const char* names[8] = {"jmp", "out", "in", "rot", "movd", "opr", "nop", "hlt"};
+	static const int ops[8] = {4, 5, 23, 39, 40, 62, 68, 81};
+	uintmax_t counts[8] = {0};
+	for (int i=0; i<94; i++) {
+		int k = 6; // every other instruction is a nop
+		for (int j=0; j<8; j++) {
+			if (ops[j] == i) {
+				k = j;
+			}
+		}
+		counts[k] += p->ops[i];
+	}
+	fprintf(f,"{\n  \"steps\": %ju,\n",vm->step-1);
+	fprintf(f,"  \"seconds\": {\"load\": %.6f, \"fill\": %.6f, \"run\": %.6f},\n",
+			p->seconds[PROFILE_LOAD],p->seconds[PROFILE_FILL],p->seconds[PROFILE_RUN]);
+	write_counters(f,vm);
+	fprintf(f,"  \"instructions\": {");
+	for (int j=0; j<8; j++) {
+		fprintf(f,"%s\"%s\": %ju",(j ? ", " : ""),names[j],counts[j]);
+	}
+	fprintf(f,"},\n  \"cells\": [");
+	int first = 1;
+	for (uintmax_t i=0; i<p->cell_count; i++) {
+		if (p->cell_counts[i]) {
+			fprintf(f,"%s\n    {\"address\": %ju, \"offset\": %zu, \"count\": %ju}",
+					(first ? "" : ","),i,p->offsets[i],p->cell_counts[i]);
+			first = 0;
+		}
+	}
+	fprintf(f,"%s],\n  \"other_cells\": %ju,\n",(first ? "" : "\n  "),p->outside);
+	fprintf(f,"  \"memptr\": {\"cached\": %ju, \"walks\": ",p->cached);
+	write_histogram(f,p->walks);
+	fprintf(f,"},\n  \"widths\": {\"a\": ");
+	write_histogram(f,p->widths[0]);
+	fprintf(f,", \"c\": ");
+	write_histogram(f,p->widths[1]);
+	fprintf(f,", \"d\": ");
+	write_histogram(f,p->widths[2]);
+	fprintf(f,"}\n}\n");
+	if (fclose(f) != 0) {
+		fprintf(stderr,"error: cannot write profile %s\n",path);
+	}
+}
+#endif
+
+/*
+ * Execution traces. --trace FILE records the state after every step, and
+ * --replay FILE checks a run against such a trace and stops at the first
+ * step that differs. A state is the executed instruction (0-7: jmp, out,
+ * in, rot, movd, opr, hlt, nop), C, pos, A and D. C and D are addresses,
+ * or, if they are negative or too wide, digests; A is always a digest. A
+ * digest is the 32 bit FNV-1a hash of the head and the trits up to the
+ * highest one that differs from the head, from the least significant.
+ *
+ * The file starts with "MUTRACE2" and the first step as 64 bit little
+ * endian. Blocks of records follow, each with its compressed size, its
+ * size and its number of steps as 32 bit little endian; the state is reset
+ * at the start of each block, so blocks decode independently. A block is
+ * compressed with a small LZ77 in the format of LZ4 blocks: sequences of a
+ * token byte holding the number of literals and the match length minus 4
+ * (15: more bytes follow, each added, up to one below 255), the literals,
+ * and the offset of the match as 16 bit little endian; the last sequence
+ * has literals only. A record is a header byte followed by varints (7 bits
+ * per byte, least significant first):
+ *
+ *   header bits 0-2: instruction; 3: C is a digest; 4: D is a digest;
+ *                    5: pos is given; 6: A is given; 7: repetition
+ *   C, D: the digest, or the zigzag encoded difference from the previous
+ *         value plus 1
+ *   pos: if given; otherwise the previous pos plus 1, modulo 564
+ *   A: if given; otherwise unchanged
+ *
+ * A header of just the repetition bit is followed by a count, and applies
+ * the previous record that many more times. In a straight run of code a
+ * step takes three bytes before repetitions. At the start of a block C
+ * and D are -1, pos is 563 and A is 0.
+ *
+ * The interpreter runs one step per mu_run and appends records to a
+ * block; full blocks go through a small ring to a writer thread, which
+ * compresses and writes them, so traces of any length need a fixed amount
+ * of memory. The records are encoded on the interpreter thread: the
+ * digests and addresses take time in the width of A, C and D, and those
+ * registers change with the next step, so handing them over would copy as
+ * much. On one core recording costs about 120 to 190 ns per step, about
+ * 20 of them for the separate mu_run calls.
+ */
+
+#define TRACE_BLOCK (1 << 20)
+#define TRACE_RECORD_MAX 32
+#define TRACE_BUFFERS 4
+#define TRACE_REPEAT 0x80
+#define LZ_HASH_BITS 14
+#define LZ_BOUND(n) ((n) + (n)/255 + 16) // compressed size of n bytes at worst
+
+typedef struct TraceState {
+	int op;
+	int c_digest;
+	int d_digest;
+	uint64_t c;
+	uint64_t d;
+	uint64_t a;
+	int pos;
+} TraceState;
+
+typedef struct TraceBuffer {
+	unsigned char* data;
+	size_t len;
+	uint32_t steps;
+} TraceBuffer;
+
+typedef struct Trace {
+	FILE* f;
+	int replay;
+	uintmax_t executed[EXECUTED_COUNT]; // of the vm after the last step
+	TraceState state;
+	// recording
+	TraceBuffer buffers[TRACE_BUFFERS];
+	size_t filled; // buffers handed to the writer
+	size_t written; // buffers written by the writer
+	int write_error;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t writer;
+	uint32_t* table; // hash table of the compressor, used by the writer
+	unsigned char last[TRACE_RECORD_MAX]; // encoding of the previous record
+	size_t last_len;
+	uintmax_t repeat; // repetitions of the previous record not yet written
+	unsigned char* packed; // a compressed block
+	// replaying
+	unsigned char* block;
+	size_t block_len;
+	size_t block_pos;
+	uint32_t block_steps;
+	uintmax_t pending; // repetitions of the previous record left
+	size_t last_pos; // offset of the previous record in block
+} Trace;
+
+static uint32_t digest_number(Number* n) {
+	uint32_t h = 2166136261u;
+	h = (h ^ (uint32_t)n->head) * 16777619u;
+	uintmax_t width = get_real_width(n);
+	Trits* it = n->tail;
+	for (uintmax_t i=0; i<width; i++) {
+		h = (h ^ (uint32_t)it->trit) * 16777619u;
+		it = it->left;
+	}
+	return h;
+}
+
+// the address of n, or its digest if it has none; returns 1 for a digest
+static int trace_location(Number* n, uint64_t* value) {
+	uintmax_t addr;
+	if (number_to_address(n,&addr) && addr <= UINT64_MAX) {
+		*value = addr;
+		return 0;
+	}
+	*value = digest_number(n);
+	return 1;
+}
+
+static inline unsigned char* put_varint(unsigned char* p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char)value;
+	return p;
+}
+
+static inline int get_varint(const unsigned char* p, size_t len, size_t* pos, uint64_t* value) {
+	*value = 0;
+	for (int shift=0; shift<64 && *pos<len; shift+=7) {
+		unsigned char byte = p[(*pos)++];
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline uint64_t zigzag(uint64_t delta) {
+	return (delta << 1) ^ (uint64_t)-(int64_t)(delta >> 63);
+}
+
+static inline uint64_t unzigzag(uint64_t value) {
+	return (value >> 1) ^ (uint64_t)-(int64_t)(value & 1);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+	for (int i=0; i<4; i++) {
+		p[i] = (unsigned char)(v >> 8*i);
+	}
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void reset_trace_state(TraceState* s) {
+	s->c = UINT64_MAX;
+	s->d = UINT64_MAX;
+	s->c_digest = 0;
+	s->d_digest = 0;
+	s->pos = 563;
+	s->a = 0;
+}
+
+// the state of vm after a step; executed holds the counts before it
+static void trace_state(Vm* vm, const uintmax_t* executed, TraceState* s) {
+	s->op = EXECUTED_COUNT; // nop
+	for (int i=0; i<EXECUTED_COUNT; i++) {
+		if (vm->executed[i] != executed[i]) {
+			s->op = i;
+		}
+	}
+	s->c_digest = trace_location(vm->c,&s->c);
+	s->d_digest = trace_location(vm->d,&s->d);
+	s->pos = vm->pos;
+	s->a = digest_number(vm->a);
+}
+
+// encodes s relative to prev; returns the length
+static size_t encode_trace_record(const TraceState* prev, const TraceState* s, unsigned char* buf) {
+	unsigned char* p = buf+1;
+	p = put_varint(p,(s->c_digest ? s->c : zigzag(s->c - (prev->c+1))));
+	p = put_varint(p,(s->d_digest ? s->d : zigzag(s->d - (prev->d+1))));
+	int pos_given = (s->pos != (prev->pos+1) % 564);
+	if (pos_given) {
+		p = put_varint(p,(uint64_t)s->pos);
+	}
+	int a_given = (s->a != prev->a);
+	if (a_given) {
+		p = put_varint(p,s->a);
+	}
+	buf[0] = (unsigned char)(s->op | s->c_digest << 3 | s->d_digest << 4 | pos_given << 5 | a_given << 6);
+	return p - buf;
+}
+
+// applies the record at p to s; returns 0 on success
+static int decode_trace_record(const unsigned char* p, size_t len, size_t* pos, TraceState* s) {
+	if (*pos >= len) {
+		return 1;
+	}
+	int header = p[(*pos)++];
+	uint64_t c, d, value;
+	if (get_varint(p,len,pos,&c) || get_varint(p,len,pos,&d)) {
+		return 1;
+	}
+	s->op = header & 7;
+	s->c_digest = (header >> 3) & 1;
+	s->d_digest = (header >> 4) & 1;
+	s->c = (s->c_digest ? c : s->c + 1 + unzigzag(c));
+	s->d = (s->d_digest ? d : s->d + 1 + unzigzag(d));
+	if (header & 0x20) {
+		if (get_varint(p,len,pos,&value) || value >= 564) {
+			return 1;
+		}
+		s->pos = (int)value;
+	}else{
+		s->pos = (s->pos + 1) % 564;
+	}
+	if (header & 0x40) {
+		if (get_varint(p,len,pos,&value)) {
+			return 1;
+		}
+		s->a = value;
+	}
+	return 0;
+}
+
+static inline unsigned char* put_lz_length(unsigned char* p, size_t len) {
+	while (len >= 255) {
+		*p++ = 255;
+		len -= 255;
+	}
+	*p++ = (unsigned char)len;
+	return p;
+}
+
+static inline int get_lz_length(const unsigned char* p, size_t len, size_t* pos, size_t* value) {
+	unsigned char byte;
+	do {
+		if (*pos >= len) {
+			return 1;
+		}
+		byte = p[(*pos)++];
+		*value += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+// appends a sequence of literals and a match of match_len bytes, if any, at offset back
+static unsigned char* put_lz_sequence(unsigned char* p, const unsigned char* literals, size_t literal_len, size_t offset, size_t match_len) {
+	unsigned char* token = p++;
+	*token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4);
+	if (literal_len >= 15) {
+		p = put_lz_length(p,literal_len-15);
+	}
+	memcpy(p,literals,literal_len);
+	p += literal_len;
+	if (match_len) {
+		*p++ = (unsigned char)offset;
+		*p++ = (unsigned char)(offset >> 8);
+		match_len -= 4;
+		*token |= (unsigned char)(match_len < 15 ? match_len : 15);
+		if (match_len >= 15) {
+			p = put_lz_length(p,match_len-15);
+		}
+	}
+	return p;
+}
+
+// compresses len bytes of src into dst, which holds LZ_BOUND(len); returns the compressed length
+static size_t lz_compress(const unsigned char* src, size_t len, unsigned char* dst, uint32_t* table) {
+	memset(table,0,sizeof(uint32_t) << LZ_HASH_BITS);
+	unsigned char* p = dst;
+	size_t anchor = 0;
+	size_t i = 0;
+	while (i+4 <= len) {
+		uint32_t v;
+		memcpy(&v,src+i,4);
+		uint32_t h = (v*2654435761u) >> (32-LZ_HASH_BITS);
+		size_t candidate = table[h];
+		table[h] = (uint32_t)i;
+		if (candidate < i && i-candidate <= 0xFFFF && memcmp(src+candidate,src+i,4) == 0) {
+			size_t match = 4;
+			while (i+match < len && src[candidate+match] == src[i+match]) {
+				match++;
+			}
+			p = put_lz_sequence(p,src+anchor,i-anchor,i-candidate,match);
+			i += match;
+			anchor = i;
+		}else{
+			i++;
+		}
+	}
+	// the last sequence has no match
+	p = put_lz_sequence(p,src+anchor,len-anchor,0,0);
+	return p - dst;
+}
+
+// expands len bytes of src into dst of size bytes; returns the expanded length or SIZE_MAX if src is corrupt
+static size_t lz_expand(const unsigned char* src, size_t len, unsigned char* dst, size_t size) {
+	size_t i = 0;
+	size_t out = 0;
+	while (i < len) {
+		int token = src[i++];
+		size_t literal_len = token >> 4;
+		if ((literal_len == 15 && get_lz_length(src,len,&i,&literal_len))
+				|| literal_len > len-i || literal_len > size-out) {
+			return SIZE_MAX;
+		}
+		memcpy(dst+out,src+i,literal_len);
+		i += literal_len;
+		out += literal_len;
+		if (i == len) {
+			break;
+		}
+		if (len-i < 2) {
+			return SIZE_MAX;
+		}
+		size_t offset = src[i] | (size_t)src[i+1] << 8;
+		i += 2;
+		size_t match = token & 15;
+		if ((match == 15 && get_lz_length(src,len,&i,&match)) || !offset || offset > out || match+4 > size-out) {
+			return SIZE_MAX;
+		}
+		// byte by byte: a match may overlap the bytes it produces
+		for (size_t end=out+match+4; out<end; out++) {
+			dst[out] = dst[out-offset];
+		}
+	}
+	return out;
+}
+
+static void* trace_writer(void* arg) {
+	Trace* t = (Trace*)arg;
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while (t->written == t->filled && !t->done) {
+			pthread_cond_wait(&t->cond,&t->lock);
+		}
+		if (t->written == t->filled) {
+			break;
+		}
+		TraceBuffer* b = &t->buffers[t->written % TRACE_BUFFERS];
+		pthread_mutex_unlock(&t->lock);
+		size_t len = lz_compress(b->data,b->len,t->packed,t->table);
+		unsigned char header[12];
+		put_u32(header,(uint32_t)len);
+		put_u32(header+4,(uint32_t)b->len);
+		put_u32(header+8,b->steps);
+		int error = (fwrite(header,1,12,t->f) != 12 || fwrite(t->packed,1,len,t->f) != len);
+		pthread_mutex_lock(&t->lock);
+		t->write_error |= error;
+		t->written++;
+		pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+static inline TraceBuffer* trace_buffer(Trace* t) {
+	return &t->buffers[t->filled % TRACE_BUFFERS];
+}
+
+static void flush_trace_repeat(Trace* t) {
+	if (t->repeat) {
+		TraceBuffer* b = trace_buffer(t);
+		b->data[b->len++] = TRACE_REPEAT;
+		b->len = put_varint(b->data+b->len,t->repeat) - b->data;
+		t->repeat = 0;
+	}
+}
+
+// hands the current block to the writer and waits for a free buffer
+static void hand_over_trace_block(Trace* t) {
+	flush_trace_repeat(t);
+	pthread_mutex_lock(&t->lock);
+	t->filled++;
+	pthread_cond_broadcast(&t->cond);
+	while (t->filled - t->written == TRACE_BUFFERS) {
+		pthread_cond_wait(&t->cond,&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+	TraceBuffer* b = trace_buffer(t);
+	b->len = 0;
+	b->steps = 0;
+	reset_trace_state(&t->state);
+	t->last_len = 0;
+}
+
+static void record_step(Trace* t, Vm* vm) {
+	TraceState s;
+	trace_state(vm,t->executed,&s);
+	TraceBuffer* b = trace_buffer(t);
+	if (b->len > TRACE_BLOCK - 2*TRACE_RECORD_MAX) {
+		hand_over_trace_block(t);
+		b = trace_buffer(t);
+	}
+	unsigned char record[TRACE_RECORD_MAX];
+	size_t len = encode_trace_record(&t->state,&s,record);
+	if (len == t->last_len && memcmp(record,t->last,len) == 0) {
+		t->repeat++;
+	}else{
+		flush_trace_repeat(t);
+		memcpy(b->data+b->len,record,len);
+		b->len += len;
+		memcpy(t->last,record,len);
+		t->last_len = len;
+	}
+	b->steps++;
+	t->state = s;
+}
+
+// reads the next block; returns 0 on success, 1 at the end of the trace and -1 on an error
+static int read_trace_block(Trace* t) {
+	unsigned char header[12];
+	size_t n = fread(header,1,12,t->f);
+	if (n == 0 && feof(t->f)) {
+		return 1;
+	}
+	if (n != 12) {
+		return -1;
+	}
+	uint32_t len = get_u32(header);
+	uint32_t expanded = get_u32(header+4);
+	if (len > LZ_BOUND(TRACE_BLOCK) || expanded > TRACE_BLOCK || fread(t->packed,1,len,t->f) != len
+			|| lz_expand(t->packed,len,t->block,TRACE_BLOCK) != expanded) {
+		return -1;
+	}
+	t->block_len = expanded;
+	t->block_steps = get_u32(header+8);
+	t->block_pos = 0;
+	t->pending = 0;
+	reset_trace_state(&t->state);
+	return 0;
+}
+
+// decodes the next state into t->state; returns 0 on success, 1 at the end of the trace and -1 on an error
+static int next_trace_state(Trace* t) {
+	while (!t->block_steps) {
+		int ret = read_trace_block(t);
+		if (ret) {
+			return ret;
+		}
+	}
+	t->block_steps--;
+	if (t->pending) {
+		t->pending--;
+		size_t pos = t->last_pos;
+		return (decode_trace_record(t->block,t->block_len,&pos,&t->state) ? -1 : 0);
+	}
+	if (t->block_pos < t->block_len && t->block[t->block_pos] == TRACE_REPEAT) {
+		uint64_t count;
+		t->block_pos++;
+		if (get_varint(t->block,t->block_len,&t->block_pos,&count) || !count) {
+			return -1;
+		}
+		t->pending = count - 1;
+		size_t pos = t->last_pos;
+		return (decode_trace_record(t->block,t->block_len,&pos,&t->state) ? -1 : 0);
+	}
+	t->last_pos = t->block_pos;
+	return (decode_trace_record(t->block,t->block_len,&t->block_pos,&t->state) ? -1 : 0);
+}
+
+// returns 0 on success
+static int open_trace(Trace* t, const char* path, int replay, Vm* vm) {
+	memset(t,0,sizeof(Trace));
+	t->replay = replay;
+	t->f = fopen(path,(replay ? "rb" : "wb"));
+	if (!t->f) {
+		fprintf(stderr,"error: cannot open trace %s\n",path);
+		return 1;
+	}
+	unsigned char header[16];
+	uint64_t first = vm->step;
+	memcpy(t->executed,vm->executed,sizeof(t->executed));
+	reset_trace_state(&t->state);
+	if (replay) {
+		if (fread(header,1,16,t->f) != 16 || memcmp(header,"MUTRACE2",8) != 0) {
+			fprintf(stderr,"error: not a trace: %s\n",path);
+			return 1;
+		}
+		first = get_u32(header+8) | (uint64_t)get_u32(header+12) << 32;
+		if (first != vm->step) {
+			fprintf(stderr,"error: the trace starts at step %" PRIu64 ", the run at step %ju\n",first,vm->step);
+			return 1;
+		}
+		t->block = (unsigned char*)malloc_or_die(TRACE_BLOCK);
+		t->packed = (unsigned char*)malloc_or_die(LZ_BOUND(TRACE_BLOCK));
+		return 0;
+	}
+	memcpy(header,"MUTRACE2",8);
+	put_u32(header+8,(uint32_t)first);
+	put_u32(header+12,(uint32_t)(first >> 32));
+	if (fwrite(header,1,16,t->f) != 16) {
+		fprintf(stderr,"error: cannot write trace %s\n",path);
+		return 1;
+	}
+	for (int i=0; i<TRACE_BUFFERS; i++) {
+		t->buffers[i].data = (unsigned char*)malloc_or_die(TRACE_BLOCK);
+	}
+	t->packed = (unsigned char*)malloc_or_die(LZ_BOUND(TRACE_BLOCK));
+	t->table = (uint32_t*)malloc_or_die(sizeof(uint32_t) << LZ_HASH_BITS);
+	pthread_mutex_init(&t->lock,0);
+	pthread_cond_init(&t->cond,0);
+	if (pthread_create(&t->writer,0,trace_writer,t) != 0) {
+		fprintf(stderr,"error: cannot create thread\n");
+		exit(1);
+	}
+	return 0;
+}
+
+static const char* trace_op_name(int op) {
+	static const char* names[EXECUTED_COUNT+1] = {"jmp", "out", "in", "rot", "movd", "opr", "hlt", "nop"};
+	return names[op];
+}
+
+// an address in decimal, a digest in hexadecimal after a '#'
+static void format_trace_field(const char* field, const TraceState* s, char* buf) {
+	if (field[0] == 'p') {
+		sprintf(buf,"%d",s->pos);
+	}else if (field[0] == 'A') {
+		sprintf(buf,"#%08" PRIx64,s->a);
+	}else{
+		int digest = (field[0] == 'C' ? s->c_digest : s->d_digest);
+		uint64_t value = (field[0] == 'C' ? s->c : s->d);
+		sprintf(buf,(digest ? "#%08" PRIx64 : "%" PRIu64),value);
+	}
+}
+
+// checks the state of vm after a step against the trace; returns 0 if they match
+static int check_step(Trace* t, Vm* vm) {
+	TraceState s;
+	trace_state(vm,t->executed,&s);
+	uintmax_t step = vm->step - (s.op != EXECUTED_HLT); // hlt does not advance the step
+	int ret = next_trace_state(t);
+	if (ret) {
+		fprintf(stderr,(ret > 0 ? "trace ends before step %ju\n" : "error: corrupt trace at step %ju\n"),step);
+		return 1;
+	}
+	TraceState* e = &t->state;
+	const char* field = 0;
+	if (s.op != e->op) {
+		fprintf(stderr,"trace diverges in step %ju: instruction %s, expected %s\n",step,trace_op_name(s.op),trace_op_name(e->op));
+		return 1;
+	}else if (s.c_digest != e->c_digest || s.c != e->c) {
+		field = "C";
+	}else if (s.pos != e->pos) {
+		field = "pos";
+	}else if (s.a != e->a) {
+		field = "A";
+	}else if (s.d_digest != e->d_digest || s.d != e->d) {
+		field = "D";
+	}
+	if (field) {
+		char got[32], expected[32];
+		format_trace_field(field,&s,got);
+		format_trace_field(field,e,expected);
+		fprintf(stderr,"trace diverges in step %ju after %s: %s is %s, expected %s\n",step,trace_op_name(s.op),field,got,expected);
+		return 1;
+	}
+	return 0;
+}
+
+// records or checks the step just executed; returns 0 to go on
+static int trace_step(Trace* t, Vm* vm) {
+	int ret = 0;
+	if (t->replay) {
+		ret = check_step(t,vm);
+	}else{
+		record_step(t,vm);
+	}
+	memcpy(t->executed,vm->executed,sizeof(t->executed));
+	return ret;
+}
+
+// finishes the trace; returns 0 on success
+static int close_trace(Trace* t, Vm* vm) {
+	int ret = 0;
+	if (t->replay) {
+		int end = 0;
+		while (!t->block_steps && !end) {
+			end = read_trace_block(t);
+		}
+		if (end < 0) {
+			fprintf(stderr,"error: corrupt trace after step %ju\n",vm->step);
+			ret = 1;
+		}else if (!end) {
+			fprintf(stderr,"trace continues after the run ends in step %ju\n",vm->step);
+			ret = 1;
+		}
+		free(t->block);
+		free(t->packed);
+	}else{
+		if (trace_buffer(t)->steps) {
+			hand_over_trace_block(t);
+		}
+		pthread_mutex_lock(&t->lock);
+		t->done = 1;
+		pthread_cond_broadcast(&t->cond);
+		pthread_mutex_unlock(&t->lock);
+		pthread_join(t->writer,0);
+		ret = t->write_error;
+		for (int i=0; i<TRACE_BUFFERS; i++) {
+			free(t->buffers[i].data);
+		}
+		free(t->packed);
+		free(t->table);
+		pthread_mutex_destroy(&t->lock);
+		pthread_cond_destroy(&t->cond);
+	}
+	if (fclose(t->f) != 0 || ret) {
+		if (!t->replay) {
+			fprintf(stderr,"error: cannot write trace\n");
+		}
+		ret = 1;
+	}
+	return ret;
+}
+
+// reports the error of the vm, if any; returns the exit status
+static int report_error(Vm* vm) {
+	if (vm->status == MU_ERROR) {
+		fprintf(stderr,"%s\n",mu_error(vm));
+	}
+	return 1;
+}
+
+/*
+ * Fork server: the program is loaded once and every run is a forked child
+ * that starts at the first step and shares the initialized memory copy-on-
+ * write. A client connects to the Unix domain socket and sends one byte
+ * carrying its stdin, stdout and stderr as SCM_RIGHTS. The server answers
+ * with one byte, the exit status of the run (128 + signal if it was
+ * killed), and closes the connection. unshackled --fork-client is such a
+ * client.
+ */
+
+typedef struct Client {
+	pid_t pid;
+	int conn;
+} Client;
+
+static int sigchld_pipe[2];
+
+static void notify_sigchld(int sig) {
+	(void)sig;
+	int saved_errno = errno;
+	if (write(sigchld_pipe[1],"",1) < 0) {
+		// the pipe is full; the server is already woken up
+	}
+	errno = saved_errno;
+}
+
+static int unix_socket_address(const char* path, struct sockaddr_un* addr) {
+	memset(addr,0,sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr,"socket path too long: %s\n",path);
+		return 1;
+	}
+	strcpy(addr->sun_path,path);
+	return 0;
+}
+
+// receives the stdin, stdout and stderr of a client; returns 0 on success
+static int receive_stdio(int conn, int fds[3]) {
+	char byte;
+	struct iovec iov = {&byte, 1};
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(3*sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+	if (recvmsg(conn,&msg,MSG_CMSG_CLOEXEC) != 1) {
+		return 1;
+	}
+	struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+		return 1;
+	}
+	size_t count = (c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+	int received[3];
+	memcpy(received,CMSG_DATA(c),count*sizeof(int));
+	if (count != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+		for (size_t i=0;i<count;i++) {
+			close(received[i]);
+		}
+		return 1;
+	}
+	memcpy(fds,received,sizeof(received));
+	return 0;
+}
+
+// runs the vm in a forked child with the stdio of a client; does not return
+static void serve_client(Vm* vm, int fds[3], int server, Client* clients, size_t client_count) {
+	signal(SIGCHLD,SIG_DFL);
+	close(server);
+	close(sigchld_pipe[0]);
+	close(sigchld_pipe[1]);
+	for (size_t i=0;i<client_count;i++) {
+		close(clients[i].conn);
+	}
+	for (int i=0;i<3;i++) {
+		if (dup2(fds[i],i) < 0) {
+			_exit(1);
+		}
+	}
+	for (int i=0;i<3;i++) {
+		if (fds[i] > 2) {
+			close(fds[i]);
+		}
+	}
+	int status;
+	while ((status = mu_run(vm,UINTMAX_MAX)) == MU_RUNNING) {
+	}
+	int ret = (status == MU_ERROR ? report_error(vm) : 0);
+	fflush(stdout);
+	_exit(ret);
+}
+
+// reports the exit status of finished runs to their clients
+static void reap_clients(Client* clients, size_t* client_count) {
+	char drain[64];
+	while (read(sigchld_pipe[0],drain,sizeof(drain)) > 0) {
+	}
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1,&status,WNOHANG)) > 0) {
+		for (size_t i=0;i<*client_count;i++) {
+			if (clients[i].pid == pid) {
+				unsigned char code = (unsigned char)(WIFEXITED(status) ? WEXITSTATUS(status) : 128+WTERMSIG(status));
+				send(clients[i].conn,&code,1,MSG_NOSIGNAL);
+				close(clients[i].conn);
+				clients[i] = clients[--*client_count];
 				break;
-			case 5: // out
-				// compare A with ...21
-				if (is_nl(a)) {
-					printf("\n");
-				}else{
-					update_unicode(a);
-					print_utf8(a->unicode);
+			}
+		}
+	}
+}
+
+// serves runs of the loaded program on the socket at path until killed
+static int run_fork_server(Vm* vm, const char* path) {
+	// a child must not depend on the loader thread
+	if (vm->stream && finish_stream(vm)) {
+		return report_error(vm);
+	}
+	struct sockaddr_un addr;
+	if (unix_socket_address(path,&addr)) {
+		return 1;
+	}
+	int server = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	unlink(path);
+	if (server < 0 || bind(server,(struct sockaddr*)&addr,sizeof(addr)) || listen(server,SOMAXCONN)) {
+		fprintf(stderr,"error: cannot listen on %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	if (pipe(sigchld_pipe) || fcntl(sigchld_pipe[0],F_SETFL,O_NONBLOCK) || fcntl(sigchld_pipe[1],F_SETFL,O_NONBLOCK)) {
+		fprintf(stderr,"error: cannot create pipe\n");
+		return 1;
+	}
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = notify_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD,&sa,0);
+
+	Client* clients = 0;
+	size_t client_count = 0;
+	size_t client_size = 0;
+	for (;;) {
+		struct pollfd fds[2] = {{server, POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}};
+		if (poll(fds,2,-1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr,"error: poll failed: %s\n",strerror(errno));
+			return 1;
+		}
+		if (fds[1].revents) {
+			reap_clients(clients,&client_count);
+		}
+		if (!fds[0].revents) {
+			continue;
+		}
+		int conn = accept(server,0,0);
+		if (conn < 0) {
+			continue;
+		}
+		int stdio[3];
+		if (receive_stdio(conn,stdio)) {
+			close(conn);
+			continue;
+		}
+		if (client_count == client_size) {
+			client_size = (client_size ? 2*client_size : 16);
+			clients = (Client*)realloc(clients,client_size*sizeof(Client));
+			if (!clients) {
+				fprintf(stderr,"out of memory");
+				return 1;
+			}
+		}
+		fflush(stdout);
+		fflush(stderr);
+		pid_t pid = fork();
+		if (pid == 0) {
+			serve_client(vm,stdio,server,clients,client_count);
+		}
+		for (int i=0;i<3;i++) {
+			close(stdio[i]);
+		}
+		if (pid < 0) {
+			unsigned char code = 1;
+			send(conn,&code,1,MSG_NOSIGNAL);
+			close(conn);
+			continue;
+		}
+		clients[client_count].pid = pid;
+		clients[client_count].conn = conn;
+		client_count++;
+	}
+}
+
+// runs the program of the fork server at path with our stdio; returns its exit status
+static int run_fork_client(const char* path) {
+	struct sockaddr_un addr;
+	if (unix_socket_address(path,&addr)) {
+		return 1;
+	}
+	int conn = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if (conn < 0 || connect(conn,(struct sockaddr*)&addr,sizeof(addr))) {
+		fprintf(stderr,"error: cannot connect to %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	char byte = 0;
+	struct iovec iov = {&byte, 1};
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(3*sizeof(int))];
+	} control;
+	memset(&control,0,sizeof(control));
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+	struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(3*sizeof(int));
+	int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	memcpy(CMSG_DATA(c),stdio,sizeof(stdio));
+	if (sendmsg(conn,&msg,MSG_NOSIGNAL) != 1) {
+		fprintf(stderr,"error: cannot send to %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+	unsigned char code;
+	ssize_t n;
+	while ((n = recv(conn,&code,1,0)) < 0 && errno == EINTR) {
+	}
+	if (n != 1) {
+		fprintf(stderr,"error: fork server closed the connection\n");
+		return 1;
+	}
+	return code;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+			"usage: %s [options] [program]\n"
+			"       %s --interleave [--quantum N] [--input FILE]... program...\n"
+			"       %s --sweep [--sweep-jobs N] [--input FILE]... program\n"
+			"       %s --batch MANIFEST [--batch-threads N]\n"
+			"       %s --fork-client SOCKET\n"
+			"       %s --read-metrics FILE...\n"
+			"Reads the program from stdin if no file is given.\n"
+			"  --checkpoint PREFIX         write checkpoints to PREFIX.base and PREFIX.log\n"
+			"  --checkpoint-interval N     steps between checkpoints (default: 100000000)\n"
+			"  --checkpoint-fork           write checkpoints from a forked child without pausing\n"
+			"                              ignored with --trace and --replay\n"
+			"  --checkpoint-wait           with --checkpoint-fork: wait for the last child before exit\n"
+			"  --restore PREFIX            resume from the checkpoint at PREFIX\n"
+			"  --compact PREFIX            merge PREFIX.log into PREFIX.base and exit\n"
+			"  --compile-image FILE        write the initialized program as image to FILE and exit\n"
+			"  --image FILE                run the program image FILE\n"
+			"  --image-cache DIR           share initialized programs through images in DIR\n"
+			"                              (preferably on tmpfs, e.g. /dev/shm/unshackled)\n"
+			"  --load-threads N            threads for loading large programs (default: all cores)\n"
+			"  --stream                    start executing while the program is still loading;\n"
+			"                              ignored with --checkpoint, --compile-image and --image-cache\n"
+			"                              and when the program is read from stdin\n"
+			"  --seed N                    seed for the rotation width policy (default: current time)\n"
+			"  --io-threads                decode input and encode output on threads of their own;\n"
+			"                              ignored with --checkpoint\n"
+			"  --bytes                     read and write bytes instead of UTF-8: every input byte is\n"
+			"                              a code point, output is the low byte of the code point;\n"
+			"                              not with --interleave, --sweep and --batch\n"
+			"  --memory-stats              write memory statistics to stderr at exit and on SIGUSR1\n"
+			"  --metrics FILE              publish counters in FILE, mapped shared (preferably on\n"
+			"                              /dev/shm), while running\n"
+			"  --read-metrics              print the counters in the given FILEs as OpenMetrics\n"
+			"  --trace FILE                record the state after every step in FILE\n"
+			"  --replay FILE               check every step against the trace in FILE and stop\n"
+			"                              at the first one that differs\n"
+			"  --flush POLICY              when to write output besides when the buffer is full:\n"
+			"                              size (never), line (after newlines) or input (also\n"
+			"                              before reading); default: input on a terminal, else size\n"
+			"  --interleave                run several jobs on one thread; every program runs with\n"
+			"                              the input of the same position, a single program with\n"
+			"                              every input; output is written in job order\n"
+			"  --input FILE                input of the next job (default: no input)\n"
+			"  --quantum N                 steps a job runs before the next one (default: 10000)\n"
+			"  --sweep                     run the program with every input like --interleave;\n"
+			"                              runs share their steps until their input differs\n"
+			"  --sweep-jobs N              processes for --sweep at once (default: all cores)\n"
+			"  --batch MANIFEST            run the jobs listed in MANIFEST, one per line:\n"
+			"                              program input|- output [budget]; writes a report\n"
+			"  --batch-threads N           threads for --batch (default: all cores)\n"
+			"  --fork-server SOCKET        load the program once, then run it in a forked child\n"
+			"                              for every client connecting to SOCKET\n"
+			"  --fork-client SOCKET        run the program of the fork server at SOCKET with\n"
+			"                              this process' stdin, stdout and stderr\n"
+#ifdef PROFILE
+			"  --profile FILE              write instruction, cell, trie walk and width counts and\n"
+			"                              the time and hardware counters of each phase as JSON\n"
+			"                              to FILE at exit\n"
+#endif
+			,name,name,name,name,name,name);
+}
+
+int main(int argc, char* argv[]) {
+	Checkpointer ck = {0, 0, 0, 0, 0, 0};
+	const char* restore_prefix = 0;
+	const char* compact_prefix = 0;
+	const char* compile_image = 0;
+	const char* image = 0;
+	const char* image_cache = 0;
+	int stream = 0;
+	int interleave = 0;
+	int sweep = 0;
+	uintmax_t quantum = 10000;
+	char** inputs = 0;
+	int input_count = 0;
+	const char* manifest = 0;
+	long batch_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long sweep_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* fork_server = 0;
+	const char* fork_client = 0;
+	long load_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t seed = (uint64_t)time(NULL);
+	int flush = -1;
+	int raw = 0;
+	int io_threads = 0;
+	int memory_stats = 0;
+	const char* metrics_path = 0;
+	const char* trace_path = 0;
+	int replay = 0;
+	int read_metrics_mode = 0;
+#ifdef PROFILE
+	const char* profile = 0;
+#endif
+	uintmax_t checkpoint_interval = 100000000;
+	static const struct option long_options[] = {
+		{"checkpoint", required_argument, 0, 'C'},
+		{"checkpoint-interval", required_argument, 0, 'I'},
+		{"checkpoint-fork", no_argument, 0, 'F'},
+		{"checkpoint-wait", no_argument, 0, 'W'},
+		{"restore", required_argument, 0, 'R'},
+		{"compact", required_argument, 0, 'K'},
+		{"compile-image", required_argument, 0, 'O'},
+		{"image", required_argument, 0, 'M'},
+		{"image-cache", required_argument, 0, 'D'},
+		{"load-threads", required_argument, 0, 'T'},
+		{"stream", no_argument, 0, 'S'},
+		{"seed", required_argument, 0, 'E'},
+		{"bytes", no_argument, 0, 'A'},
+		{"flush", required_argument, 0, 'H'},
+		{"io-threads", no_argument, 0, 'Y'},
+		{"memory-stats", no_argument, 0, 'Z'},
+		{"metrics", required_argument, 0, 'V'},
+		{"read-metrics", no_argument, 0, 'r'},
+		{"trace", required_argument, 0, 't'},
+		{"replay", required_argument, 0, 'y'},
+		{"interleave", no_argument, 0, 'L'},
+		{"input", required_argument, 0, 'N'},
+		{"quantum", required_argument, 0, 'Q'},
+		{"sweep", no_argument, 0, 'U'},
+		{"sweep-jobs", required_argument, 0, 'j'},
+		{"batch", required_argument, 0, 'B'},
+		{"batch-threads", required_argument, 0, 'P'},
+		{"fork-server", required_argument, 0, 'G'},
+		{"fork-client", required_argument, 0, 'J'},
+#ifdef PROFILE
+		{"profile", required_argument, 0, 'X'},
+#endif
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int opt;
+	while ((opt = getopt_long(argc,argv,"h",long_options,0)) != -1) {
+		switch (opt) {
+			case 'C':
+				ck.prefix = optarg;
+				break;
+			case 'F':
+				ck.fork = 1;
+				break;
+			case 'W':
+				ck.wait = 1;
+				break;
+			case 'I':
+				checkpoint_interval = strtoumax(optarg,0,10);
+				if (checkpoint_interval == 0) {
+					fprintf(stderr,"invalid checkpoint interval: %s\n",optarg);
+					return 1;
 				}
 				break;
-			case 23: // in
-			{
-				int32_t in = read_utf8_character();
-				free_number(&a);
-				if (in == -1) {
-					a = to_number(2);
-					a->head = T2;
-					a->unicode = -1;
-				}else if (in == '\n') {
-					a = to_number(1);
-					a->head = T2;
+			case 'R':
+				restore_prefix = optarg;
+				break;
+			case 'K':
+				compact_prefix = optarg;
+				break;
+			case 'O':
+				compile_image = optarg;
+				break;
+			case 'M':
+				image = optarg;
+				break;
+			case 'D':
+				image_cache = optarg;
+				break;
+			case 'S':
+				stream = 1;
+				break;
+			case 'E':
+				seed = strtoull(optarg,0,10);
+				break;
+			case 'A':
+				raw = 1;
+				break;
+			case 'H':
+				if (strcmp(optarg,"size") == 0) {
+					flush = MU_FLUSH_SIZE;
+				}else if (strcmp(optarg,"line") == 0) {
+					flush = MU_FLUSH_LINE;
+				}else if (strcmp(optarg,"input") == 0) {
+					flush = MU_FLUSH_INPUT;
 				}else{
-					a = to_number(in);
+					fprintf(stderr,"invalid flush policy: %s\n",optarg);
+					return 1;
 				}
 				break;
-			}
-			case 39: // rot
-				if (!d->memptr->val) {
-					d->memptr->val = clone_number(initial_values[mod(d,6)]);
-				}else{
-					repair_number_after_xlat2(d->memptr->val);
+			case 'Y':
+				io_threads = 1;
+				break;
+			case 'Z':
+				memory_stats = 1;
+				break;
+			case 'V':
+				metrics_path = optarg;
+				break;
+			case 'r':
+				read_metrics_mode = 1;
+				break;
+			case 't':
+				trace_path = optarg;
+				replay = 0;
+				break;
+			case 'y':
+				trace_path = optarg;
+				replay = 1;
+				break;
+#ifdef PROFILE
+			case 'X':
+				profile = optarg;
+				break;
+#endif
+			case 'L':
+				interleave = 1;
+				break;
+			case 'U':
+				sweep = 1;
+				break;
+			case 'j':
+				sweep_jobs = strtol(optarg,0,10);
+				if (sweep_jobs < 1 || sweep_jobs > 65536) {
+					fprintf(stderr,"invalid number of processes: %s\n",optarg);
+					return 1;
 				}
-				rotate_r(d->memptr->val, rotwidth);
-				copy_number(a,d->memptr->val);
 				break;
-			case 40: // movd
-				if (!d->memptr->val) {
-					copy_number(d,initial_values[mod(d,6)]);
-				}else{
-					repair_number_after_xlat2(d->memptr->val);
-					update_memptr(d->memptr->val,memory);
-					copy_number(d, d->memptr->val);
+			case 'N':
+				inputs = (char**)realloc(inputs,(input_count+1)*sizeof(char*));
+				if (!inputs) {
+					fprintf(stderr,"out of memory");
+					return 1;
 				}
-				update_memptr(d,memory);
-				// check rotwidth
-				if (d->width > max_wordwidth) {
-					uintmax_t w = get_real_width(d);
-					if (w > max_wordwidth) {
-						max_wordwidth = w;
-						if (det_growth) {
-							rotwidth = det_growth_policy(max_wordwidth, rotwidth, growth_step, growth_slack);
-						}else{
-							rotwidth = nondet_growth_policy(max_wordwidth, rotwidth, growth_prob, growth_slack);
-						}
-					}
+				inputs[input_count++] = optarg;
+				break;
+			case 'B':
+				manifest = optarg;
+				break;
+			case 'P':
+				batch_threads = strtol(optarg,0,10);
+				if (batch_threads < 1 || batch_threads > 1024) {
+					fprintf(stderr,"invalid number of threads: %s\n",optarg);
+					return 1;
 				}
 				break;
-			case 62: // opr
-				if (!d->memptr->val) {
-					d->memptr->val = clone_number(initial_values[mod(d,6)]);
-				}else{
-					repair_number_after_xlat2(d->memptr->val);
+			case 'G':
+				fork_server = optarg;
+				break;
+			case 'J':
+				fork_client = optarg;
+				break;
+			case 'Q':
+				quantum = strtoumax(optarg,0,10);
+				if (quantum == 0) {
+					fprintf(stderr,"invalid quantum: %s\n",optarg);
+					return 1;
 				}
-				opr(a,d->memptr->val);
 				break;
-			case 81: // hlt
-				return 0;
-			case 68:
-			default: // nop
+			case 'T':
+				load_threads = strtol(optarg,0,10);
+				if (load_threads < 1 || load_threads > 1024) {
+					fprintf(stderr,"invalid number of threads: %s\n",optarg);
+					return 1;
+				}
 				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
 		}
-		xlat2(c->memptr->val);
-		prev = c->memptr;
-		increment(c);
-		update_memptr(c,memory);
-		if (!prev->next) {
-			prev->next = c->memptr;
+	}
+
+	if (fork_client) {
+		return run_fork_client(fork_client);
+	}
+	if (read_metrics_mode) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
 		}
-		pos++;
-		pos %= 564;
-		prev = d->memptr;
-		increment(d);
-		update_memptr(d,memory);
-		if (!prev->next) {
-			prev->next = d->memptr;
+		return read_metrics(argv+optind,argc-optind);
+	}
+	if (manifest) {
+		return run_batch(manifest,(int)batch_threads,seed);
+	}
+	if (sweep) {
+		if (optind != argc-1) {
+			usage(argv[0]);
+			return 1;
+		}
+		return run_sweep(argv[optind],inputs,input_count,(int)sweep_jobs,seed);
+	}
+	if (interleave) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return run_interleaved(argv+optind,argc-optind,inputs,input_count,quantum,seed);
+	}
+
+	Vm* vm = mu_create(seed);
+	mu_set_flush(vm,flush);
+	mu_set_raw(vm,raw);
+	if (memory_stats) {
+		stats_vm = vm;
+		struct sigaction sa;
+		memset(&sa,0,sizeof(sa));
+		sa.sa_handler = report_memory_stats;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1,&sa,0);
+	}
+
+	if (compact_prefix) {
+		restore_checkpoint(vm,compact_prefix);
+		return write_base(vm,compact_prefix,new_base_id(vm));
+	}
+
+	if (restore_prefix) {
+		ck.base_id = restore_checkpoint(vm,restore_prefix);
+		ck.have_base = (ck.prefix && strcmp(ck.prefix,restore_prefix) == 0);
+	}else if (image) {
+		if (mu_load_image(vm,image)) {
+			return report_error(vm);
+		}
+	}else{
+		int fd;
+		if (optind >= argc) {
+			// read program code from STDIN
+			fd = STDIN_FILENO;
+		}else{
+			fd = open(argv[optind],O_RDONLY);
+		}
+		if (fd < 0) {
+			fprintf(stderr, "file not found: %s\n",argv[optind]);
+			return 1;
+		}
+		// stdin is also the input of the program, so it cannot be loaded while running
+		if (stream && !compile_image && !ck.prefix && !image_cache && fd != STDIN_FILENO) {
+			// the loader thread owns fd from now on
+			mu_load_stream(vm,fd);
+		}else if (image_cache && !compile_image) {
+			int err = load_cached(vm,image_cache,fd,load_threads);
+			if (fd != STDIN_FILENO) {
+				close(fd);
+			}
+			if (err) {
+				return report_error(vm);
+			}
+		}else{
+			Source src;
+			if (read_source(fd,&src)) {
+				return 1;
+			}
+			if (fd != STDIN_FILENO) {
+				close(fd);
+			}
+			if (load_source(vm,src.data,src.size,load_threads)) {
+				return report_error(vm);
+			}
+			if (compile_image) {
+				FILE* f = fopen(compile_image,"wb");
+				if (!f) {
+					fprintf(stderr,"error: cannot write image %s\n",compile_image);
+					return 1;
+				}
+				if (write_image(vm,f,src.data,src.size)) {
+					fprintf(stderr,"error: cannot write image %s\n",compile_image);
+					return 1;
+				}
+				return 0;
+			}
+			free_source(&src);
+		}
+	}
+
+	if (fork_server) {
+		return run_fork_server(vm,fork_server);
+	}
+
+	// step at which to write the next checkpoint
+	uintmax_t next_checkpoint = UINTMAX_MAX;
+	if (ck.prefix) {
+		vm->track_dirty = 1;
+		next_checkpoint = (ck.have_base ? vm->step + checkpoint_interval : vm->step);
+		if (ck.wait) {
+			exit_checkpointer = &ck;
+			atexit(wait_for_checkpoint);
+		}
+	}
+
+	// step at which to update the metrics page next
+	uintmax_t next_metrics = UINTMAX_MAX;
+	Metrics metrics;
+	if (metrics_path) {
+		if (open_metrics(&metrics,metrics_path,vm)) {
+			return 1;
+		}
+		next_metrics = vm->step + METRICS_INTERVAL;
+	}
+
+	Trace trace;
+	if (trace_path && open_trace(&trace,trace_path,replay,vm)) {
+		return 1;
+	}
+	// a child forked while the trace writer holds its stream could write
+	// the buffered trace a second time
+	if (trace_path) {
+		ck.fork = 0;
+	}
+
+	// output must be written by the time a checkpoint is
+	IoThreads* io = (io_threads && !ck.prefix ? start_io_threads(vm) : 0);
+
+	int status;
+	int diverged = 0;
+	while (1) {
+		uintmax_t next_stop = (next_checkpoint < next_metrics ? next_checkpoint : next_metrics);
+		if (trace_path) {
+			next_stop = vm->step + 1; // one step at a time
+		}
+		status = mu_run(vm,next_stop-vm->step);
+		if (trace_path && status != MU_ERROR && trace_step(&trace,vm)) {
+			diverged = 1;
+			break;
+		}
+		if (status != MU_RUNNING) {
+			break;
 		}
-		step++;
+		if (vm->step >= next_metrics) {
+			update_metrics(&metrics,vm,1);
+			next_metrics = vm->step + METRICS_INTERVAL;
+		}
+		if (vm->step >= next_checkpoint) {
+			uintmax_t interval = (checkpoint(vm,&ck) ? checkpoint_interval : CHECKPOINT_RETRY);
+			next_checkpoint = vm->step + (interval < checkpoint_interval ? interval : checkpoint_interval);
+		}
+	}
+	if (io && stop_io_threads(io)) {
+		status = vm_fail(vm,"error: output error");
+	}
+	if (trace_path && !diverged && close_trace(&trace,vm)) {
+		diverged = 1;
+	}
+	if (metrics_path) {
+		update_metrics(&metrics,vm,0);
+	}
+#ifdef PROFILE
+	if (profile) {
+		write_profile(vm,profile);
+	}
+#endif
+	if (memory_stats) {
+		write_memory_stats(vm);
+	}
+	if (status == MU_ERROR) {
+		return report_error(vm);
 	}
+	return diverged;
 }
+#endif
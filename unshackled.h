@@ -0,0 +1,129 @@
+/**
+ * Library interface of the Malbolge Unshackled interpreter.
+ *
+ * Build libunshackled.a with make. Every vm owns its memory, its random
+ * number generator and its I/O, so any number of vms can live in one
+ * process. A vm must not be used by several threads at the same time.
+ *
+ * Malbolge Unshackled uses Unicode for I/O; the I/O callbacks exchange
+ * code points. The default I/O uses UTF-8, or raw bytes, on stdin and
+ * stdout. Without callbacks, mu_run returns whenever the program writes a
+ * character or waits for input, so a single thread can drive many vms
+ * without ever blocking.
+ */
+
+#ifndef UNSHACKLED_H
+#define UNSHACKLED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Vm MuVm;
+
+// results of mu_step and mu_run
+#define MU_RUNNING 0
+#define MU_HALTED 1
+#define MU_ERROR 2
+#define MU_NEED_INPUT 3 // no read callback and no input fed; see mu_feed
+#define MU_HAVE_OUTPUT 4 // no write callback; see mu_output
+#define MU_BUDGET_EXHAUSTED MU_RUNNING
+
+// returned by the read callback instead of a code point
+#define MU_EOF -1
+#define MU_INPUT_ERROR -2
+#define MU_WOULD_BLOCK -3 // mu_run returns MU_NEED_INPUT
+
+typedef struct MuIo {
+	// returns the next code point, MU_EOF, MU_INPUT_ERROR or MU_WOULD_BLOCK; 0: use mu_feed
+	int32_t (*read)(void* ctx);
+	// writes a code point; a newline is written as '\n'; returns 0 on success; 0: use mu_output
+	int (*write)(void* ctx, int32_t symbol);
+	void* ctx;
+} MuIo;
+
+// creates a vm without a program; seed selects the rotation width policy
+MuVm* mu_create(uint64_t seed);
+
+// waits for a loader still reading the program and releases all memory of the vm
+void mu_destroy(MuVm* vm);
+
+void mu_set_io(MuVm* vm, const MuIo* io);
+
+// when the default output is written to stdout besides when its buffer is full
+#define MU_FLUSH_SIZE 0
+#define MU_FLUSH_LINE 1 // also after every newline
+#define MU_FLUSH_INPUT 2 // also after every newline and before reading input
+// sets the flush policy of the default output; the default is MU_FLUSH_INPUT
+// if stdout is a terminal and MU_FLUSH_SIZE otherwise
+void mu_set_flush(MuVm* vm, int policy);
+
+// makes the default I/O exchange bytes instead of UTF-8 if raw is set:
+// every input byte is read as the code point of its value, and the low
+// byte of every code point is written
+void mu_set_raw(MuVm* vm, int raw);
+
+// the load functions expect a vm without a program and return 0 on success
+
+// loads the program from source using up to threads threads
+int mu_load(MuVm* vm, const char* source, size_t size, int threads);
+
+// maps a program image written by unshackled --compile-image
+int mu_load_image(MuVm* vm, const char* path);
+
+// starts a thread loading the program from fd while the vm may already run;
+// fd must stay open until the vm is destroyed
+int mu_load_stream(MuVm* vm, int fd);
+
+// executes one instruction; returns MU_RUNNING or one of the results of mu_run
+int mu_step(MuVm* vm);
+
+// executes at most budget instructions; returns MU_BUDGET_EXHAUSTED if all of
+// them were executed, or early with MU_HALTED, MU_ERROR, MU_NEED_INPUT (the
+// input instruction is executed by the next call) or MU_HAVE_OUTPUT (after
+// the output instruction)
+int mu_run(MuVm* vm, uintmax_t budget);
+
+// queues input for a vm without read callback
+void mu_feed(MuVm* vm, const int32_t* symbols, size_t count);
+
+// makes the current state the one mu_reset returns to, typically right after
+// loading; from then on the vm logs the original value of every cell it
+// changes. Waits for a streaming load. Returns 0 on success.
+int mu_snapshot(MuVm* vm);
+
+// returns the vm to its last snapshot and drops queued input, in time
+// proportional to the cells changed since. The peak object counts of
+// mu_memory_stats start over from the objects in use. Returns 0 on success.
+int mu_reset(MuVm* vm);
+
+// ends the input of a vm without read callback; it reads MU_EOF once the queue is empty
+void mu_close_input(MuVm* vm);
+
+// code point written by the instruction that returned MU_HAVE_OUTPUT
+int32_t mu_output(const MuVm* vm);
+
+// number of the next step, starting at 1
+uintmax_t mu_steps(const MuVm* vm);
+
+// bytes of memory held by the vm; this is also its peak
+size_t mu_memory(const MuVm* vm);
+
+typedef struct MuMemoryStats {
+	size_t heap; // bytes allocated by the vm
+	size_t image; // bytes of a mapped program image
+	// objects in use and their peak: trits, numbers, memory cells and trie nodes
+	size_t live[4];
+	size_t peak[4];
+	size_t sizes[4]; // bytes per object
+	uintmax_t rotwidth;
+	uintmax_t max_wordwidth;
+} MuMemoryStats;
+
+// fills stats with the memory accounting of the vm; only reads the vm, so
+// a signal handler interrupting it may call this
+void mu_memory_stats(const MuVm* vm, MuMemoryStats* stats);
+
+// message describing the last MU_ERROR
+const char* mu_error(const MuVm* vm);
+
+#endif